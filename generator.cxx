@@ -1,12 +1,52 @@
-#include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <filesystem>
+#include <future>
 #include <algorithm>
 #include <stdexcept>
 #include <vector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <span>
+#include <variant>
+#include <unordered_map>
+#include <type_traits>
+#include <utility>
+#include <tuple>
+#include <random>
+#include <set>
+#include <map>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <charconv>
+#include <condition_variable>
+#include <cstdarg>
 #include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstring>
+#include <link.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <nlohmann/json.hpp>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <sys/syscall.h>
+#endif
 
 constexpr int grid10_height = 8;
 
@@ -14,6 +54,13 @@ using json = nlohmann::ordered_json;
 
 namespace {
 
+// A broken invariant of the generator itself, not a problem with its input.
+class InternalError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
 struct Block
 {
   std::string key;
@@ -25,41 +72,90 @@ struct Block
   int height = 0;
   int margin_left = 0;
   int margin_right = 0;
+  int header_extra = 0; // Columns of margin_right that the header spans too (--header-fit=widen).
   bool keyid_compact = false;
 };
 
-static std::vector<Block>* g_blocks = nullptr;
+// Per thread, so that batch inputs can be laid out in parallel (--jobs).
+// g_blocks_mut is only set while packing, the one time that blocks change.
+thread_local std::vector<Block> const* g_blocks = nullptr;
+thread_local std::vector<Block>* g_blocks_mut = nullptr;
 
 class BlocksScope
 {
 public:
   explicit BlocksScope(std::vector<Block>& blocks)
       : m_prev(g_blocks)
+      , m_prev_mut(g_blocks_mut)
+  {
+    g_blocks = &blocks;
+    g_blocks_mut = &blocks;
+  }
+
+  // Read-only access for the passes after layout.
+  explicit BlocksScope(std::vector<Block> const& blocks)
+      : m_prev(g_blocks)
+      , m_prev_mut(g_blocks_mut)
   {
     g_blocks = &blocks;
+    g_blocks_mut = nullptr;
   }
 
-  ~BlocksScope() { g_blocks = m_prev; }
+  ~BlocksScope()
+  {
+    g_blocks = m_prev;
+    g_blocks_mut = m_prev_mut;
+  }
 
   BlocksScope(BlocksScope const&) = delete;
   BlocksScope& operator=(BlocksScope const&) = delete;
 
 private:
-  std::vector<Block>* m_prev = nullptr;
+  std::vector<Block> const* m_prev = nullptr;
+  std::vector<Block>* m_prev_mut = nullptr;
+};
+
+// Counts of the expensive layout decisions, used by --find-slow as coverage feedback.
+struct LayoutCounters
+{
+  std::uint64_t rebuilds = 0;             // RowGroup::add had to re-add all blocks at a new height.
+  std::uint64_t blocks_readded = 0;       // Blocks re-added by those rebuilds.
+  std::uint64_t compaction_attempts = 0;  // KEY_ID compactions that rebuilt the group.
+  std::uint64_t compaction_rollbacks = 0; // ... and then did not fit after all.
+  std::uint64_t groups = 0;               // Row groups started.
+
+  LayoutCounters& operator+=(LayoutCounters const& other)
+  {
+    rebuilds += other.rebuilds;
+    blocks_readded += other.blocks_readded;
+    compaction_attempts += other.compaction_attempts;
+    compaction_rollbacks += other.compaction_rollbacks;
+    groups += other.groups;
+    return *this;
+  }
+
+  // The counts since `earlier`, a copy of these counters taken before.
+  [[nodiscard]] LayoutCounters since(LayoutCounters const& earlier) const
+  {
+    return {rebuilds - earlier.rebuilds, blocks_readded - earlier.blocks_readded, compaction_attempts - earlier.compaction_attempts,
+            compaction_rollbacks - earlier.compaction_rollbacks, groups - earlier.groups};
+  }
 };
 
+thread_local LayoutCounters g_layout_counters;
+
 Block const& get_block(int index)
 {
   if (!g_blocks)
-    throw std::runtime_error("internal error: blocks not initialized");
+    throw InternalError("internal error: blocks not initialized");
   return g_blocks->at(static_cast<std::size_t>(index));
 }
 
 Block& get_block_mut(int index)
 {
-  if (!g_blocks)
-    throw std::runtime_error("internal error: blocks not initialized");
-  return g_blocks->at(static_cast<std::size_t>(index));
+  if (!g_blocks_mut)
+    throw InternalError("internal error: blocks not open for packing");
+  return g_blocks_mut->at(static_cast<std::size_t>(index));
 }
 
 class RowGroup
@@ -80,13 +176,7 @@ public:
 
   [[nodiscard]] bool empty() const { return m_columns.empty(); }
   [[nodiscard]] int height() const { return m_height; }
-  [[nodiscard]] int width() const
-  {
-    int w = 0;
-    for (auto const& c : m_columns)
-      w += c.width;
-    return w;
-  }
+  [[nodiscard]] int width() const { return m_width; }
 
   [[nodiscard]] std::vector<int> blocks_in_order() const
   {
@@ -99,7 +189,7 @@ public:
   [[nodiscard]] int last_block_index() const
   {
     if (m_columns.empty() || m_columns.back().blocks.empty())
-      throw std::runtime_error("internal error: last_block_index on empty RowGroup");
+      throw InternalError("internal error: last_block_index on empty RowGroup");
     return m_columns.back().blocks.back();
   }
 
@@ -113,7 +203,7 @@ public:
   [[nodiscard]] Column const& last_column() const
   {
     if (m_columns.empty())
-      throw std::runtime_error("internal error: last_column on empty RowGroup");
+      throw InternalError("internal error: last_column on empty RowGroup");
     return m_columns.back();
   }
 
@@ -135,14 +225,19 @@ public:
       int const new_height = b.height;
       RowGroup temp(m_table_width, new_height);
 
-      std::vector<int> all = blocks_in_order();
-      all.push_back(block_index);
-
-      for (int const idx : all)
+      ++g_layout_counters.rebuilds;
+      for (auto const& col : m_columns)
       {
-        if (!temp.add_fixed_height(idx))
-          return false;
+        g_layout_counters.blocks_readded += col.blocks.size();
+        for (int const idx : col.blocks)
+        {
+          if (!temp.add_fixed_height(idx))
+            return false;
+        }
       }
+      ++g_layout_counters.blocks_readded;
+      if (!temp.add_fixed_height(block_index))
+        return false;
 
       *this = std::move(temp);
       new_block_added(block_index);
@@ -204,6 +299,7 @@ private:
 
     col.blocks.push_back(block_index);
     col.height += b.height;
+    m_width = new_total_width;
     col.width = new_col_width;
     return true;
   }
@@ -225,28 +321,76 @@ private:
     col.height = b.height;
     col.blocks.push_back(block_index);
     m_columns.push_back(std::move(col));
+    m_width += b.width;
   }
 
   int m_table_width = 0;
   int m_height = 0;
+  int m_width = 0;
   std::vector<Column> m_columns;
   int m_keyid = -1;
 };
 
-int parse_int(json const& value, std::string const& what)
+// Why a value read from the input is not valid.
+struct Unexpected
+{
+  std::string message;
+};
+
+// A value read from the input, or why it is not valid. Validation reports bad
+// input this way instead of throwing: in a validation run most inputs have
+// errors, and unwinding the stack for each of them would dominate the run time.
+// Exceptions are left for I/O and internal failures.
+template <typename T>
+class Expected
+{
+public:
+  Expected(T value)
+      : m_result(std::in_place_index<0>, std::move(value))
+  {
+  }
+
+  Expected(Unexpected error)
+      : m_result(std::in_place_index<1>, std::move(error))
+  {
+  }
+
+  [[nodiscard]] bool has_value() const { return m_result.index() == 0; }
+  explicit operator bool() const { return has_value(); }
+
+  T& operator*() { return *std::get_if<0>(&m_result); }
+  T const& operator*() const { return *std::get_if<0>(&m_result); }
+  T const* operator->() const { return std::get_if<0>(&m_result); }
+
+  [[nodiscard]] std::string const& error() const { return std::get_if<1>(&m_result)->message; }
+
+private:
+  std::variant<T, Unexpected> m_result;
+};
+
+Expected<int> parse_int(json const& value, std::string const& what)
 {
   if (value.is_number_integer())
     return value.get<int>();
   if (value.is_string())
   {
-    std::string const s = value.get<std::string>();
-    std::size_t parsed = 0;
-    int const out = std::stoi(s, &parsed, 10);
-    if (parsed != s.size())
-      throw std::runtime_error(what + " must be an integer, got '" + s + "'");
+    std::string const& s = value.get_ref<std::string const&>();
+    // Accept what std::stoi did: leading white space and an optional '+'.
+    char const* first = s.data();
+    char const* const last = s.data() + s.size();
+    while (first != last && std::isspace(static_cast<unsigned char>(*first)))
+      ++first;
+    if (first != last && *first == '+' && first + 1 != last && first[1] != '-')
+      ++first;
+    int out = 0;
+    auto const [end, ec] = std::from_chars(first, last, out, 10);
+    if (ec == std::errc::result_out_of_range)
+      return Unexpected{what + " is out of range, got '" + s + "'"};
+    if (ec != std::errc() || end != last)
+      return Unexpected{what + " must be an integer, got '" + s + "'"};
     return out;
   }
-  throw std::runtime_error(what + " must be an integer or integer string");
+  return Unexpected{what + " must be an integer or integer string"};
 }
 
 int data_width(std::string const& data)
@@ -267,62 +411,263 @@ int data_height(std::string const& data)
   return 2;
 }
 
-std::string parse_keyid_hex16(std::string const& s)
+// Horizontal advance widths, in units of 1/2048 em, of the printable ASCII
+// characters ' ' through '~' of the two fonts that sheet.css uses: DejaVu Sans
+// for the block headers and Liberation Sans (metric compatible with Arial)
+// for everything else. Any other character is assumed to be as wide as the
+// widest glyph, so that overflow is never missed.
+struct FontMetrics
 {
-  std::string hex = s;
-  if (hex.rfind("0x", 0) == 0 || hex.rfind("0X", 0) == 0)
-    hex = hex.substr(2);
+  std::array<std::uint16_t, 95> ascii;
+  std::uint16_t other;
+};
+
+constexpr int font_units_per_em = 2048;
+
+constexpr FontMetrics dejavu_sans = {
+    {
+      651, 821, 942, 1716, 1303, 1946, 1597, 563, 799, 799, 1024, 1716, 651, 739, 651, 690,
+      1303, 1303, 1303, 1303, 1303, 1303, 1303, 1303, 1303, 1303, 690, 690, 1716, 1716, 1716, 1087,
+      2048, 1401, 1405, 1430, 1577, 1294, 1178, 1587, 1540, 604, 604, 1343, 1141, 1767, 1532, 1612,
+      1235, 1612, 1423, 1300, 1251, 1499, 1401, 2025, 1403, 1251, 1403, 799, 690, 799, 1716, 1024,
+      1024, 1255, 1300, 1126, 1300, 1260, 721, 1300, 1298, 569, 569, 1186, 569, 1995, 1298, 1253,
+      1300, 1300, 842, 1067, 803, 1298, 1212, 1675, 1212, 1212, 1075, 1303, 690, 1303, 1716
+    },
+    2048};
+
+constexpr FontMetrics liberation_sans = {
+    {
+      569, 569, 727, 1139, 1139, 1821, 1366, 391, 682, 682, 797, 1196, 569, 682, 569, 569,
+      1139, 1139, 1139, 1139, 1139, 1139, 1139, 1139, 1139, 1139, 569, 569, 1196, 1196, 1196, 1139,
+      2079, 1366, 1366, 1479, 1479, 1366, 1251, 1593, 1479, 569, 1024, 1366, 1139, 1706, 1479, 1593,
+      1366, 1593, 1479, 1366, 1251, 1479, 1366, 1933, 1366, 1366, 1251, 569, 569, 569, 961, 1139,
+      682, 1139, 1139, 1024, 1139, 1139, 569, 1139, 1139, 455, 455, 1024, 455, 1706, 1139, 1139,
+      1139, 1139, 682, 1024, 569, 1139, 1024, 1479, 1024, 1024, 1024, 684, 532, 684, 1196
+    },
+    2079};
 
-  if (hex.size() != 16)
-    throw std::runtime_error("keyid must be optional '0x' followed by 16 hex characters");
+// The CSS pixel sizes of sheet.css: every table column is 25 px wide (the colgroup),
+// of which padding and border take 3 px; headers are font-size medium (16 px)
+// and the title 22 pt.
+constexpr int cell_width_px = 25;
+constexpr int cell_chrome_px = 3;
+constexpr int header_font_px = 16;
+constexpr int title_font_px = 29;
 
-  for (unsigned char const ch : hex)
+// The width of UTF-8 `text` in font units; multiply by the font size in px and divide by font_units_per_em for px.
+long text_width(FontMetrics const& font, std::string_view text)
+{
+  long width = 0;
+  for (unsigned char const ch : text)
   {
-    if (!std::isxdigit(ch))
-      throw std::runtime_error("keyid must be optional '0x' followed by 16 hex characters");
+    if (ch >= ' ' && ch <= '~')
+      width += font.ascii[ch - ' '];
+    else if ((ch & 0xc0) != 0x80) // Count a multi-byte character once, at its lead byte.
+      width += font.other;
   }
+  return width;
+}
+
+// Whether `text` in font size `font_px` fits in `px` pixels.
+bool text_fits(FontMetrics const& font, std::string_view text, int font_px, int px)
+{
+  return text_width(font, text) * font_px <= static_cast<long>(px) * font_units_per_em;
+}
 
-  return hex;
+// The number of table columns that a header cell needs to show `header` on one line.
+int header_cells_needed(std::string_view header)
+{
+  long const px = (text_width(dejavu_sans, header) * header_font_px + font_units_per_em - 1) / font_units_per_em;
+  return static_cast<int>((px + cell_chrome_px + cell_width_px - 1) / cell_width_px);
 }
 
-std::string html_escape(std::string const& s)
+// Shorten `header` to the longest prefix that, followed by an ellipsis, fits in `cells` columns.
+std::string abbreviate_header(std::string_view header, int cells)
+{
+  std::string_view constexpr ellipsis = "\u2026";
+  int const px = cells * cell_width_px - cell_chrome_px;
+  std::size_t length = header.size();
+  while (length > 0)
+  {
+    // Cut at a character boundary and drop trailing spaces.
+    do
+      --length;
+    while (length > 0 && (static_cast<unsigned char>(header[length]) & 0xc0) == 0x80);
+    while (length > 0 && header[length - 1] == ' ')
+      --length;
+    std::string abbreviated(header.substr(0, length));
+    abbreviated += ellipsis;
+    if (length == 0 || text_fits(dejavu_sans, abbreviated, header_font_px, px))
+      return abbreviated;
+  }
+  return std::string(ellipsis);
+}
+
+Expected<std::string> parse_keyid_hex16(std::string const& s)
+{
+  std::string_view hex = s;
+  if (hex.starts_with("0x") || hex.starts_with("0X"))
+    hex.remove_prefix(2);
+
+  if (hex.size() != 16 || !std::all_of(hex.begin(), hex.end(), [](unsigned char ch) { return std::isxdigit(ch); }))
+    return Unexpected{"keyid must be optional '0x' followed by 16 hex characters"};
+
+  return std::string(hex);
+}
+
+constexpr void append_html_escaped(std::string& out, char ch)
+{
+  switch (ch)
+  {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;"; break;
+    case '>': out += "&gt;"; break;
+    case '"': out += "&quot;"; break;
+    default: out += ch; break;
+  }
+}
+
+constexpr void append_html_escaped(std::string& out, std::string_view s)
 {
-  std::string out;
-  out.reserve(s.size());
   for (char const ch : s)
+    append_html_escaped(out, ch);
+}
+
+constexpr void append_int(std::string& out, long long value)
+{
+  if (std::is_constant_evaluated())
   {
-    switch (ch)
+    // std::to_chars is not constexpr before C++23.
+    if (value < 0)
     {
-      case '&': out += "&amp;"; break;
-      case '<': out += "&lt;"; break;
-      case '>': out += "&gt;"; break;
-      case '"': out += "&quot;"; break;
-      default: out += ch; break;
+      out += '-';
+      value = -value;
     }
+    std::string digits;
+    do
+      digits += static_cast<char>('0' + value % 10);
+    while ((value /= 10) != 0);
+    out.append(digits.rbegin(), digits.rend());
+    return;
   }
-  return out;
+  std::array<char, 24> buf;
+  auto const result = std::to_chars(buf.data(), buf.data() + buf.size(), value);
+  out.append(buf.data(), result.ptr);
 }
 
-void write_empty_span(std::ostream& out, int colspan)
+// The markup of the table cells. The pretty dialect is the one the generator
+// always wrote: a tag per line and a class on every header and data cell. The
+// minified dialect (--minify) drops all formatting whitespace and the optional
+// closing tags, and writes headers as <th> and data cells with the short class
+// "d"; sheet.css styles both.
+struct HtmlDialect
+{
+  bool minified;
+  std::string_view row_open;     // Start of a table row.
+  std::string_view row_close;    // End of a table row.
+  std::string_view cell_open;    // Start of the tag of a grid or empty cell, up to the attributes.
+  std::string_view data_open;    // Start of the tag of a data cell, up to the attributes.
+  std::string_view cell_close;   // End of any cell, after its contents.
+  std::string_view empty;        // Contents of an empty cell.
+  std::string_view header_open;  // Start of the tag of a header cell, up to the attributes.
+  std::string_view header_class; // Precedes an extra class of a header cell.
+  std::string_view header_span;  // Precedes the colspan of a header cell.
+  bool grid_labels = true;       // Whether grid cells contain their character, rather than sheet.css generating it.
+};
+
+constexpr HtmlDialect pretty_html = {
+    false, "\t<tr>\n", "\t</tr>\n", "\t\t<td", "\t\t<td class=\"data\"", "</td>\n", "<br>", "\t\t<td class=\"header", " ", "\" colspan="};
+
+constexpr HtmlDialect minified_html = {true, "<tr>", "", "<td", "<td class=d", "", "", "<th", " class=", " colspan="};
+
+constexpr void write_empty_span(std::string& out, HtmlDialect const& html, int colspan)
 {
   if (colspan <= 0)
     return;
 
-  out << "\t\t<td colspan=" << colspan << "><br></td>\n";
+  out += html.cell_open;
+  out += " colspan=";
+  append_int(out, colspan);
+  out += '>';
+  out += html.empty;
+  out += html.cell_close;
+}
+
+void write_data_cell(std::string& out, HtmlDialect const& html, char ch)
+{
+  out += html.data_open;
+  out += '>';
+  append_html_escaped(out, ch);
+  out += html.cell_close;
+}
+
+constexpr void write_grid_cell(std::string& out, HtmlDialect const& html, char ch)
+{
+  out += html.cell_open;
+  out += '>';
+  if (html.grid_labels)
+    append_html_escaped(out, ch);
+  out += html.cell_close;
+}
+
+void write_block_header_row(std::string& out, HtmlDialect const& html, Block const& block, std::string_view extra_class = {})
+{
+  write_empty_span(out, html, block.margin_left);
+
+  out += html.header_open;
+  if (!extra_class.empty())
+  {
+    out += html.header_class;
+    out += extra_class;
+  }
+  out += html.header_span;
+  append_int(out, block.content_width + block.header_extra);
+  out += ">";
+  append_html_escaped(out, block.header);
+  out += html.cell_close;
+
+  write_empty_span(out, html, block.margin_right - block.header_extra);
 }
 
-void write_block_header_row(std::ostream& out, Block const& block)
+// The data rows of the grid blocks.
+enum class GridRow : std::uint8_t
 {
-  write_empty_span(out, block.margin_left);
+  grid10,
+  grid36_letters,
+  grid36_separator // Every fifth row of grid36: a "-" and one wide empty cell.
+};
 
-  out << "\t\t<td class=\"header\" colspan=" << block.content_width << ">" << html_escape(block.header) << "</td>\n";
+constexpr void write_grid_cells(std::string& out, HtmlDialect const& html, GridRow row)
+{
+  if (row == GridRow::grid10)
+  {
+    std::string_view const cells = "0123456789";
+    for (char const ch : cells)
+      write_grid_cell(out, html, ch);
+  }
+  else if (row == GridRow::grid36_letters)
+  {
+    std::string_view const cells = "-ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    for (char const ch : cells)
+      write_grid_cell(out, html, ch);
+  }
+  else
+  {
+    write_grid_cell(out, html, '-');
+    out += html.cell_open;
+    out += " colspan=36>";
+    out += html.cell_close;
+  }
+}
 
-  write_empty_span(out, block.margin_right);
+constexpr GridRow grid36_row(int data_row_index)
+{
+  return data_row_index % 5 < 4 ? GridRow::grid36_letters : GridRow::grid36_separator;
 }
 
-void write_block_data_row(std::ostream& out, Block const& block, int data_row_index)
+void write_block_data_row(std::string& out, HtmlDialect const& html, Block const& block, int data_row_index)
 {
-  write_empty_span(out, block.margin_left);
+  write_empty_span(out, html, block.margin_left);
 
   if (block.key == "keyid" || block.key == "keyid3")
   {
@@ -330,367 +675,6040 @@ void write_block_data_row(std::ostream& out, Block const& block, int data_row_in
     {
       if (data_row_index == 0)
       {
-        out << "\t\t<td class=\"data\" colspan=2 rowspan=2>" << html_escape("0 x") << "</td>\n";
+        out += html.data_open;
+        out += " colspan=2 rowspan=2>0 x";
+        out += html.cell_close;
         for (int i = 0; i < 8; ++i)
-          out << "\t\t<td class=\"data\">" << html_escape(std::string(1, block.keyid_hex16.at(i))) << "</td>\n";
+          write_data_cell(out, html, block.keyid_hex16.at(i));
       }
       else if (data_row_index == 1)
       {
         for (int i = 8; i < 16; ++i)
-          out << "\t\t<td class=\"data\">" << html_escape(std::string(1, block.keyid_hex16.at(i))) << "</td>\n";
+          write_data_cell(out, html, block.keyid_hex16.at(i));
       }
       else
       {
-        throw std::runtime_error("internal error: unexpected keyid data_row_index");
+        throw InternalError("internal error: unexpected keyid data_row_index");
       }
     }
     else
     {
-      out << "\t\t<td class=\"data\" colspan=2>" << html_escape("0 x") << "</td>\n";
+      out += html.data_open;
+      out += " colspan=2>0 x";
+      out += html.cell_close;
       for (int i = 0; i < 16; ++i)
-        out << "\t\t<td class=\"data\">" << html_escape(std::string(1, block.keyid_hex16.at(i))) << "</td>\n";
+        write_data_cell(out, html, block.keyid_hex16.at(i));
     }
   }
   else if (block.data == "grid10")
-  {
-    std::string const row = "0123456789";
-    for (char const ch : row)
-      out << "\t\t<td>" << html_escape(std::string(1, ch)) << "</td>\n";
-  }
+    write_grid_cells(out, html, GridRow::grid10);
   else if (block.data == "grid36")
-  {
-    int const pattern_index = data_row_index % 5;
-    if (pattern_index < 4)
-    {
-      std::string const row = "-ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-      for (char const ch : row)
-        out << "\t\t<td>" << html_escape(std::string(1, ch)) << "</td>\n";
-    }
-    else
-    {
-      out << "\t\t<td>-</td>\n";
-      out << "\t\t<td colspan=36></td>\n";
-    }
-  }
+    write_grid_cells(out, html, grid36_row(data_row_index));
   else
   {
     if (data_row_index != 0)
-      throw std::runtime_error("internal error: unexpected data_row_index for non-grid block '" + block.key + "'");
+      throw InternalError("internal error: unexpected data_row_index for non-grid block '" + block.key + "'");
     for (char const ch : block.data)
-      out << "\t\t<td class=\"data\">" << html_escape(std::string(1, ch)) << "</td>\n";
+      write_data_cell(out, html, ch);
+  }
+
+  write_empty_span(out, html, block.margin_right);
+}
+
+// Compile-time row emitters. Most rows of grid-heavy sheets consist of grid
+// data rows only, and a few table widths and block margins cover nearly all of
+// them. For those shapes the bytes of the whole table row are built at compile
+// time, by the same constexpr cell writers that the generic path uses, so
+// rendering such a row is a single append. Anything else takes the generic
+// path; --generic-rows forces it everywhere, for comparison (make bench-rows).
+
+bool g_generic_rows = false; // Set from the command line before any rendering.
+
+// One column of such a row: a block with a grid data row, its margins, and
+// the empty cells after it up to the width of its column.
+struct GridSegment
+{
+  GridRow row = GridRow::grid10;
+  std::uint8_t margin_left = 0;
+  std::uint8_t margin_right = 0;
+  std::uint8_t padding = 0;
+};
+
+struct GridRowShape
+{
+  bool minified = false;
+  std::uint8_t table_width = 0;
+  std::uint8_t columns = 0;
+  std::array<GridSegment, 3> segments{};
+};
+
+// Identifies a shape in specialized_rows; 0 if a margin is wider than any
+// specialized shape has.
+constexpr std::uint64_t grid_row_key(GridRowShape const& shape)
+{
+  std::uint64_t key = ((std::uint64_t{shape.minified} << 8 | shape.table_width) << 2 | shape.columns) << 33;
+  for (std::size_t c = 0; c < shape.columns; ++c)
+  {
+    GridSegment const& segment = shape.segments[c];
+    if (segment.margin_left > 7 || segment.margin_right > 7 || segment.padding > 7)
+      return 0;
+    std::uint64_t const bits = static_cast<std::uint64_t>(segment.row) << 9 | segment.margin_left << 6 | segment.margin_right << 3 | segment.padding;
+    key |= bits << (11 * c);
   }
+  return key;
+}
 
-  write_empty_span(out, block.margin_right);
+constexpr int grid_row_width(GridRow row)
+{
+  return row == GridRow::grid10 ? 10 : 37;
 }
 
-bool find_block_at_row(RowGroup::Column const& col, int row_offset, int& out_block_row, int& out_block_index)
+// The row exactly as write_sheet_html writes it cell by cell, including the
+// row classes of the minified dialect.
+constexpr void write_grid_table_row(std::string& out, GridRowShape const& shape)
 {
-  int cursor = 0;
-  for (int const idx : col.blocks)
+  HtmlDialect html = shape.minified ? minified_html : pretty_html;
+  if (shape.minified)
   {
-    Block const& b = get_block(idx);
-    if (row_offset < cursor + b.height)
+    bool all_letters = true;
+    bool all_grid10 = true;
+    for (std::size_t c = 0; c < shape.columns; ++c)
     {
-      out_block_row = row_offset - cursor;
-      out_block_index = idx;
-      return true;
+      all_letters = all_letters && shape.segments[c].row == GridRow::grid36_letters;
+      all_grid10 = all_grid10 && shape.segments[c].row == GridRow::grid10;
+    }
+    if (all_letters || all_grid10)
+    {
+      html.row_open = all_letters ? "<tr class=a>" : "<tr class=b>";
+      html.grid_labels = false;
     }
-    cursor += b.height;
   }
-  return false;
+
+  out += html.row_open;
+  int used_width = 0;
+  for (std::size_t c = 0; c < shape.columns; ++c)
+  {
+    GridSegment const& segment = shape.segments[c];
+    write_empty_span(out, html, segment.margin_left);
+    write_grid_cells(out, html, segment.row);
+    write_empty_span(out, html, segment.margin_right);
+    write_empty_span(out, html, segment.padding);
+    used_width += segment.margin_left + grid_row_width(segment.row) + segment.margin_right + segment.padding;
+  }
+  write_empty_span(out, html, shape.table_width - used_width);
+  out += html.row_close;
 }
 
-void write_sheet_html(std::ostream& output_file, json const& j, std::string const& sheet_label)
+template <GridRowShape Shape>
+constexpr auto grid_table_row = [] {
+  constexpr std::size_t size = [] {
+    std::string out;
+    write_grid_table_row(out, Shape);
+    return out.size();
+  }();
+  std::array<char, size> bytes{};
+  std::string out;
+  write_grid_table_row(out, Shape);
+  std::copy(out.begin(), out.end(), bytes.begin());
+  return bytes;
+}();
+
+constexpr GridRowShape grid_row_shape(bool minified, int table_width, std::initializer_list<GridSegment> segments)
 {
-  std::string const title_left = j.at("title").at("left").get<std::string>();
-  std::string const title_right = j.at("title").at("right").get<std::string>();
-  int const table_width = parse_int(j.at("table").at("width"), sheet_label + ".table.width");
+  GridRowShape shape{minified, static_cast<std::uint8_t>(table_width), static_cast<std::uint8_t>(segments.size())};
+  std::copy(segments.begin(), segments.end(), shape.segments.begin());
+  return shape;
+}
 
-  std::cout << sheet_label << ".title.left: " << title_left << "\n";
-  std::cout << sheet_label << ".title.right: " << title_right << "\n";
-  std::cout << sheet_label << ".table.width: " << table_width << "\n\n";
+// The specialized shapes: full width grid36 rows in tables of width 37, and
+// rows of one or two grid10 blocks (three in width 37) with the margins that
+// the shipped and benchmark sheets use, in tables of width 26 and 37; each in
+// both dialects.
+constexpr auto common_grid_rows = [] {
+  constexpr GridSegment letters{GridRow::grid36_letters};
+  constexpr GridSegment separator{GridRow::grid36_separator};
+  constexpr std::array<GridSegment, 4> digits = {{{GridRow::grid10, 1, 0}, {GridRow::grid10, 2, 0}, {GridRow::grid10, 0, 2}, {GridRow::grid10, 1, 1}}};
+  std::array<GridRowShape, 2 * (2 + 2 * (4 + 4 * 4) + 4)> shapes{};
+  std::size_t n = 0;
+  for (bool const minified : {false, true})
+  {
+    shapes[n++] = grid_row_shape(minified, 37, {letters});
+    shapes[n++] = grid_row_shape(minified, 37, {separator});
+    for (int const width : {26, 37})
+    {
+      for (GridSegment const& a : digits)
+      {
+        shapes[n++] = grid_row_shape(minified, width, {a});
+        for (GridSegment const& b : digits)
+          shapes[n++] = grid_row_shape(minified, width, {a, b});
+      }
+    }
+    for (GridSegment const& a : digits)
+      shapes[n++] = grid_row_shape(minified, 37, {a, a, a});
+  }
+  return shapes;
+}();
 
-  json const& headers = j.at("data_headers");
-  json const& data = j.at("data");
-  json const& margins = j.at("margins");
+struct SpecializedRow
+{
+  std::uint64_t key = 0;
+  std::string_view bytes;
+};
 
-  if (!headers.is_object())
-    throw std::runtime_error(sheet_label + ".data_headers must be an object");
-  if (!data.is_object())
-    throw std::runtime_error(sheet_label + ".data must be an object");
-  if (!margins.is_object())
-    throw std::runtime_error(sheet_label + ".margins must be an object");
+// Sorted by key.
+template <std::size_t... I>
+constexpr auto make_specialized_rows(std::index_sequence<I...>)
+{
+  std::array<SpecializedRow, sizeof...(I)> rows = {
+      SpecializedRow{grid_row_key(common_grid_rows[I]), {grid_table_row<common_grid_rows[I]>.data(), grid_table_row<common_grid_rows[I]>.size()}}...};
+  std::sort(rows.begin(), rows.end(), [](SpecializedRow const& a, SpecializedRow const& b) { return a.key < b.key; });
+  return rows;
+}
 
-  std::vector<Block> blocks;
-  BlocksScope const _blocks_scope(blocks);
+constexpr auto specialized_rows = make_specialized_rows(std::make_index_sequence<common_grid_rows.size()>{});
 
-  std::vector<RowGroup> groups;
-  RowGroup current_group(table_width);
+struct ColumnCursor
+{
+  std::size_t position = 0; // Index into Column::blocks of the block at the current row.
+  int top = 0;              // Row offset of that block.
+};
 
-  for (auto const& [key, header_value] : headers.items())
+// The compile-time bytes of the current row of a row group, or nothing if the row has no specialized shape.
+std::string_view specialized_row(bool minified, int table_width, std::vector<RowGroup::Column> const& columns,
+                                 std::vector<ColumnCursor> const& cursors, int row_offset)
+{
+  GridRowShape shape{minified, static_cast<std::uint8_t>(table_width), static_cast<std::uint8_t>(columns.size())};
+  if (table_width > 255 || columns.size() > shape.segments.size())
+    return {};
+  for (std::size_t c = 0; c < columns.size(); ++c)
   {
-    if (!data.contains(key))
-      throw std::runtime_error(sheet_label + ": data_headers key '" + key + "' is missing from data");
-    if (!margins.contains(key))
-      throw std::runtime_error(sheet_label + ": data_headers key '" + key + "' is missing from margins");
-
-    std::string const header = header_value.get<std::string>();
-    std::string const data_value = data.at(key).get<std::string>();
-    json const& margin_obj = margins.at(key);
-
-    if (!margin_obj.is_object())
-      throw std::runtime_error(sheet_label + ".margins." + key + " must be an object");
-
-    int const margin_left =
-        margin_obj.contains("left") ? parse_int(margin_obj.at("left"), sheet_label + ".margins." + key + ".left") : 0;
-    int const margin_right =
-        margin_obj.contains("right") ? parse_int(margin_obj.at("right"), sheet_label + ".margins." + key + ".right") : 0;
-
-    int content_width = (key == "keyid") ? 18 : ((key == "keyid3") ? 10 : data_width(data_value));
-    int height = (key == "keyid") ? 2 : ((key == "keyid3") ? 3 : data_height(data_value));
-    std::string keyid_hex16;
-    if (key == "keyid" || key == "keyid3")
-      keyid_hex16 = parse_keyid_hex16(data_value);
-
-    int width = content_width + margin_left + margin_right;
-
-    if (width > table_width)
-      throw std::runtime_error(sheet_label + ": block '" + key + "' has width " + std::to_string(width) + " > table width " +
-                               std::to_string(table_width));
-
-    Block block;
-    block.key = key;
-    block.header = header;
-    block.data = data_value;
-    block.keyid_hex16 = keyid_hex16;
-    block.width = width;
-    block.content_width = content_width;
-    block.height = height;
-    block.margin_left = margin_left;
-    block.margin_right = margin_right;
-    block.keyid_compact = key == "keyid3";
-
-    blocks.push_back(block);
-    int const block_index = static_cast<int>(blocks.size() - 1);
+    auto const& col = columns[c];
+    if (cursors[c].position == col.blocks.size())
+      return {};
+    Block const& block = get_block(col.blocks[cursors[c].position]);
+    int const block_row = row_offset - cursors[c].top;
+    int const padding = col.width - block.width;
+    if (block_row == 0 || !block.keyid_hex16.empty() || block.margin_left > 255 || block.margin_right > 255 || padding > 255)
+      return {};
 
-    auto try_compact_last_keyid_to_fit = [&](int new_block_index) -> bool {
-      if (current_group.empty())
-        return false;
-      if (!current_group.last_column_has_single_block())
-        return false;
+    GridSegment& segment = shape.segments[c];
+    if (block.data == "grid10")
+      segment.row = GridRow::grid10;
+    else if (block.data == "grid36")
+      segment.row = grid36_row(block_row - 1);
+    else
+      return {};
+    segment.margin_left = static_cast<std::uint8_t>(block.margin_left);
+    segment.margin_right = static_cast<std::uint8_t>(block.margin_right);
+    segment.padding = static_cast<std::uint8_t>(padding);
+  }
 
-      int const keyid_index = current_group.last_block_index();
-      Block const& keyid = get_block(keyid_index);
-      if (keyid.key != "keyid" || keyid.keyid_compact)
-        return false;
-      if (current_group.last_column().width != keyid.width)
-        return false;
+  std::uint64_t const key = grid_row_key(shape);
+  auto const it = std::lower_bound(specialized_rows.begin(), specialized_rows.end(), key,
+                                   [](SpecializedRow const& row, std::uint64_t k) { return row.key < k; });
+  if (key == 0 || it == specialized_rows.end() || it->key != key)
+    return {};
+  return it->bytes;
+}
 
-      Block const saved = keyid;
-      Block& keyid_mut = get_block_mut(keyid_index);
+class IoError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
 
-      int const shrink = 8;
-      if (keyid_mut.content_width < shrink + 2)
-        return false;
-      keyid_mut.keyid_compact = true;
-      keyid_mut.content_width -= shrink;
-      keyid_mut.width -= shrink;
-      keyid_mut.height = 3;
+class MemoryBudgetError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
 
-      RowGroup rebuilt(table_width);
-      for (int const idx : current_group.blocks_in_order())
-      {
-        if (!rebuilt.add(idx))
-        {
-          keyid_mut = saved;
-          return false;
-        }
-      }
-      if (!rebuilt.add(new_block_index))
-      {
-        keyid_mut = saved;
-        return false;
-      }
+enum class Compression
+{
+  none,
+  gzip,
+  zstd
+};
 
-      current_group = std::move(rebuilt);
-      return true;
-    };
+// The file name suffix of output compressed with `compression`.
+std::string_view compressed_suffix(Compression compression)
+{
+  switch (compression)
+  {
+    case Compression::none: return "";
+    case Compression::gzip: return ".gz";
+    case Compression::zstd: return ".zst";
+  }
+  return "";
+}
 
-    if (current_group.add(block_index))
-      continue;
+// An output file that is written in chunks while the document is rendered, so
+// that the whole document never has to be held in memory. With compression,
+// each chunk goes through the compressor first and the uncompressed document
+// never reaches the disk; zstd compresses with one worker thread per core.
+class OutputFile
+{
+public:
+  // The size at which the renderers hand over what they have.
+  static constexpr std::size_t chunk_size = 64 * 1024;
 
-    if (try_compact_last_keyid_to_fit(block_index))
-      continue;
+  OutputFile(std::filesystem::path path, Compression compression)
+      : m_path(std::move(path))
+      , m_compression(compression)
+      , m_buffer(chunk_size)
+  {
+#ifndef HAVE_ZSTD
+    if (m_compression == Compression::zstd)
+      throw IoError("cannot write " + m_path.string() + ": this generator was built without zstd support");
+#endif
+    // The file is opened last: when the constructor throws, the destructor does not run to close it.
+    if (m_compression == Compression::gzip)
+    {
+      // A window of 15 bits, plus 16 for a gzip header and trailer.
+      if (deflateInit2(&m_zlib, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw IoError("cannot initialize gzip compression for " + m_path.string());
+    }
+#ifdef HAVE_ZSTD
+    else if (m_compression == Compression::zstd)
+    {
+      m_zstd = ZSTD_createCCtx();
+      if (!m_zstd)
+        throw IoError("cannot initialize zstd compression for " + m_path.string());
+      ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, 12);
+      // Fails harmlessly, compressing on this thread, if libzstd was built without multi-threading.
+      ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_nbWorkers, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+#endif
+    m_file = std::fopen(m_path.c_str(), "wb");
+    if (!m_file)
+    {
+      end_compression();
+      throw IoError("unable to open output file " + m_path.string());
+    }
+  }
 
-    if (!current_group.empty())
-      groups.push_back(std::move(current_group));
+  OutputFile(OutputFile const&) = delete;
+  OutputFile& operator=(OutputFile const&) = delete;
 
-    current_group = RowGroup(table_width);
-    if (!current_group.add(block_index))
-      throw std::runtime_error("internal error: failed to start new RowGroup");
+  ~OutputFile()
+  {
+    end_compression();
+    if (m_file)
+      std::fclose(m_file);
   }
 
-  if (!current_group.empty())
-    groups.push_back(std::move(current_group));
+  void write(std::string_view chunk)
+  {
+    m_bytes_in += chunk.size();
+    compress(chunk, false);
+  }
 
-  int group_top = 0;
-  for (RowGroup const& group : groups)
+  // Flush the compressor and close the file.
+  void close()
   {
-    int col_left = 0;
-    for (auto const& col : group.columns())
-    {
-      int col_top = group_top;
-      for (int const idx : col.blocks)
-      {
-        Block const& b = get_block(idx);
-        std::cout << b.key << ": header='" << b.header << "' data='" << b.data << "' top=" << col_top << " left=" << col_left << " width=" << b.width
-                  << " height=" << b.height;
-        if (b.key == "keyid")
-          std::cout << " compact=" << (b.keyid_compact ? 1 : 0);
-        std::cout << "\n";
-        col_top += b.height;
-      }
-      col_left += col.width;
-    }
-    group_top += group.height();
+    compress({}, true);
+    std::FILE* const file = std::exchange(m_file, nullptr);
+    if (std::fclose(file) != 0)
+      throw IoError("failed to write output file " + m_path.string());
   }
 
-  output_file << "<div class=\"sheet\">\n";
-  output_file << "<h1 class=\"title\">\n";
-  output_file << "  <span>" << html_escape(title_left) << "</span>\n";
-  output_file << "  <span>" << html_escape(title_right) << "</span>\n";
-  output_file << "</h1>\n";
+  [[nodiscard]] std::size_t bytes_in() const { return m_bytes_in; }
+  [[nodiscard]] std::size_t bytes_out() const { return m_bytes_out; }
 
-  output_file << "<table cellspacing=\"0\" border=\"0\">\n";
-  output_file << "\t<colgroup span=\"" << table_width << "\" width=\"25\"></colgroup>\n";
+private:
+  void end_compression()
+  {
+    if (m_compression == Compression::gzip)
+      deflateEnd(&m_zlib);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(m_zstd);
+    m_zstd = nullptr;
+#endif
+  }
 
-  for (RowGroup const& group : groups)
+  void compress(std::string_view chunk, bool finish)
   {
-    for (int row_offset = 0; row_offset < group.height(); ++row_offset)
+    switch (m_compression)
     {
-#if 0
-      bool any_header = false;
-      for (auto const& col : group.columns())
+      case Compression::none:
+        write_raw(chunk.data(), chunk.size());
+        break;
+      case Compression::gzip:
       {
-        int block_row = 0;
-        int block_index = -1;
-        if (find_block_at_row(col, row_offset, block_row, block_index))
+        m_zlib.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+        m_zlib.avail_in = static_cast<uInt>(chunk.size());
+        int result;
+        do
         {
-          if (block_row == 0)
-          {
-            any_header = true;
-            break;
-          }
-        }
+          m_zlib.next_out = m_buffer.data();
+          m_zlib.avail_out = static_cast<uInt>(m_buffer.size());
+          result = deflate(&m_zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+          if (result == Z_STREAM_ERROR)
+            throw IoError("gzip compression of " + m_path.string() + " failed");
+          write_raw(m_buffer.data(), m_buffer.size() - m_zlib.avail_out);
+        } while (m_zlib.avail_out == 0 || (finish && result != Z_STREAM_END));
+        break;
       }
-
-      if (any_header)
-        output_file << "\t<tr class=\"header\">\n";
-      else
-#endif
-        output_file << "\t<tr>\n";
-
-      int used_width = 0;
-      for (auto const& col : group.columns())
+      case Compression::zstd:
       {
-        int block_row = 0;
-        int block_index = -1;
-        if (find_block_at_row(col, row_offset, block_row, block_index))
-        {
-          if (block_row == 0)
-            write_block_header_row(output_file, get_block(block_index));
-          else
-            write_block_data_row(output_file, get_block(block_index), block_row - 1);
-
-          write_empty_span(output_file, col.width - get_block(block_index).width);
-        }
-        else
+#ifdef HAVE_ZSTD
+        ZSTD_inBuffer input{chunk.data(), chunk.size(), 0};
+        std::size_t remaining;
+        do
         {
-          write_empty_span(output_file, col.width);
-        }
-        used_width += col.width;
+          ZSTD_outBuffer output{m_buffer.data(), m_buffer.size(), 0};
+          remaining = ZSTD_compressStream2(m_zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+          if (ZSTD_isError(remaining))
+            throw IoError("zstd compression of " + m_path.string() + " failed: " + ZSTD_getErrorName(remaining));
+          write_raw(m_buffer.data(), output.pos);
+        } while (finish ? remaining != 0 : input.pos < input.size);
+#endif
+        break;
       }
-
-      write_empty_span(output_file, table_width - used_width);
-      output_file << "\t</tr>\n";
     }
   }
 
-  output_file << "</table>\n";
-  output_file << "</div>\n";
-}
+  void write_raw(void const* data, std::size_t size)
+  {
+    if (size > 0 && std::fwrite(data, 1, size, m_file) != size)
+      throw IoError("failed to write output file " + m_path.string());
+    m_bytes_out += size;
+  }
 
-} // namespace
+  std::filesystem::path m_path;
+  Compression m_compression;
+  std::FILE* m_file = nullptr;
+  z_stream m_zlib{};
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* m_zstd = nullptr;
+#endif
+  std::vector<unsigned char> m_buffer;
+  std::size_t m_bytes_in = 0;
+  std::size_t m_bytes_out = 0;
+};
+
+// A ustar archive, written sequentially through an OutputFile (--tar). All
+// entries are regular files with mode 0644, owned by root, and get the same
+// modification time, so that the same inputs always give the same archive.
+class TarWriter
+{
+public:
+  TarWriter(std::filesystem::path path, Compression compression, long long mtime)
+      : m_file(std::move(path), compression)
+      , m_mtime(mtime)
+  {
+  }
+
+  void add(std::string const& name, std::string_view contents)
+  {
+    std::array<char, block_size> header{};
+    // Names longer than the 100 character name field are split at a slash into prefix and name.
+    std::size_t split = 0;
+    if (name.size() > 100)
+    {
+      split = name.rfind('/', 155);
+      if (split == std::string::npos || name.size() - split - 1 > 100 || split == 0)
+        throw IoError("cannot archive \"" + name + "\": the name is too long for a tar header");
+      std::memcpy(&header[345], name.data(), split);
+      ++split;
+    }
+    std::memcpy(&header[0], name.data() + split, name.size() - split);
+    write_octal(&header[100], 8, 0644); // mode
+    write_octal(&header[108], 8, 0);    // uid
+    write_octal(&header[116], 8, 0);    // gid
+    write_octal(&header[124], 12, contents.size());
+    write_octal(&header[136], 12, static_cast<unsigned long long>(m_mtime));
+    header[156] = '0'; // A regular file.
+    std::memcpy(&header[257], "ustar", 6);
+    std::memcpy(&header[263], "00", 2);
+    std::memcpy(&header[265], "root", 4); // uname
+    std::memcpy(&header[297], "root", 4); // gname
+
+    // The checksum is computed with the checksum field itself filled with spaces.
+    std::memset(&header[148], ' ', 8);
+    unsigned checksum = 0;
+    for (char const ch : header)
+      checksum += static_cast<unsigned char>(ch);
+    write_octal(&header[148], 7, checksum);
+
+    m_file.write(std::string_view(header.data(), header.size()));
+    m_file.write(contents);
+    pad();
+  }
+
+  // Write the end-of-archive marker, pad to a whole record and close the file.
+  void close()
+  {
+    std::array<char, 2 * block_size> const end{};
+    m_file.write(std::string_view(end.data(), end.size()));
+    while (m_file.bytes_in() % record_size != 0)
+      pad_block();
+    m_file.close();
+  }
+
+private:
+  static constexpr std::size_t block_size = 512;
+  static constexpr std::size_t record_size = 20 * block_size;
+
+  // A zero terminated octal number of `width - 1` digits.
+  static void write_octal(char* field, std::size_t width, unsigned long long value)
+  {
+    field[width - 1] = '\0';
+    for (std::size_t i = width - 1; i > 0; --i, value >>= 3)
+      field[i - 1] = static_cast<char>('0' + (value & 7));
+  }
+
+  void pad()
+  {
+    if (m_file.bytes_in() % block_size != 0)
+      pad_block();
+  }
+
+  void pad_block()
+  {
+    std::array<char, block_size> const zeros{};
+    m_file.write(std::string_view(zeros.data(), block_size - m_file.bytes_in() % block_size));
+  }
+
+  OutputFile m_file;
+  long long m_mtime;
+};
+
+// Process-wide counters for --metrics, written in the Prometheus text exposition format.
+class Metrics
+{
+public:
+  enum class ErrorKind { input, json_syntax, json_schema, validation, io, memory, internal };
+
+  void add_sheet(double layout_seconds, double render_seconds)
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    ++m_sheets_rendered;
+    m_layout_seconds.push_back(layout_seconds);
+    m_render_seconds.push_back(render_seconds);
+  }
+
+  void add_document(std::size_t bytes)
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    ++m_documents_written;
+    m_bytes_written += bytes;
+    auto const bucket = std::lower_bound(document_size_buckets.begin(), document_size_buckets.end(), static_cast<double>(bytes));
+    ++m_document_size_counts[static_cast<std::size_t>(bucket - document_size_buckets.begin())];
+  }
+
+  void add_error(ErrorKind kind)
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    ++m_errors[static_cast<std::size_t>(kind)];
+  }
+
+  // The KEY_ID compactions of a layout that is kept; trial layouts are not counted.
+  void add_compactions(LayoutCounters const& counters)
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    m_compactions[0] += counters.compaction_rollbacks;
+    m_compactions[1] += counters.compaction_attempts - counters.compaction_rollbacks;
+  }
+
+  void add_cache_lookup(std::string const& cache, bool hit)
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    ++m_cache_lookups[cache][hit ? 1 : 0];
+  }
+
+  [[nodiscard]] std::string prometheus_text() const
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    std::string out;
+
+    auto counter = [&](char const* name, char const* help) {
+      out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+    };
+    auto sample = [&](std::string const& name, double value) {
+      char buf[64];
+      std::snprintf(buf, sizeof(buf), " %.9g\n", value);
+      out += name + buf;
+    };
+
+    counter("passphrase_sheets_rendered_total", "Sheets laid out and rendered.");
+    sample("passphrase_sheets_rendered_total", static_cast<double>(m_sheets_rendered));
+    counter("passphrase_bytes_written_total", "Bytes of output written.");
+    sample("passphrase_bytes_written_total", static_cast<double>(m_bytes_written));
+
+    counter("passphrase_errors_total", "Failed inputs, by kind of error.");
+    static constexpr std::array<char const*, number_of_error_kinds> error_kind_names = {"input", "json_syntax", "json_schema", "validation",
+                                                                                         "io",    "memory",      "internal"};
+    for (std::size_t kind = 0; kind < number_of_error_kinds; ++kind)
+      sample(std::string("passphrase_errors_total{kind=\"") + error_kind_names[kind] + "\"}", static_cast<double>(m_errors[kind]));
+
+    counter("passphrase_keyid_compactions_total", "Attempts to compact a KEY_ID block to fit the next block, by result.");
+    sample("passphrase_keyid_compactions_total{result=\"rolled_back\"}", static_cast<double>(m_compactions[0]));
+    sample("passphrase_keyid_compactions_total{result=\"success\"}", static_cast<double>(m_compactions[1]));
+
+    if (!m_cache_lookups.empty())
+    {
+      counter("passphrase_cache_lookups_total", "Cache lookups, by cache and result.");
+      for (auto const& [cache, counts] : m_cache_lookups)
+      {
+        sample("passphrase_cache_lookups_total{cache=\"" + cache + "\",result=\"miss\"}", static_cast<double>(counts[0]));
+        sample("passphrase_cache_lookups_total{cache=\"" + cache + "\",result=\"hit\"}", static_cast<double>(counts[1]));
+      }
+    }
+
+    auto summary = [&](char const* name, char const* help, std::vector<double> samples) {
+      out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " summary\n";
+      std::sort(samples.begin(), samples.end());
+      for (double const q : {0.5, 0.9, 0.99})
+      {
+        double value = 0.0;
+        if (!samples.empty())
+          value = samples[static_cast<std::size_t>(q * static_cast<double>(samples.size() - 1) + 0.5)];
+        char quantile[32];
+        std::snprintf(quantile, sizeof(quantile), "{quantile=\"%g\"}", q);
+        sample(name + std::string(quantile), value);
+      }
+      double sum = 0.0;
+      for (double const s : samples)
+        sum += s;
+      sample(name + std::string("_sum"), sum);
+      sample(name + std::string("_count"), static_cast<double>(samples.size()));
+    };
+    summary("passphrase_layout_duration_seconds", "Time to lay out one sheet.", m_layout_seconds);
+    summary("passphrase_render_duration_seconds", "Time to render one sheet to HTML.", m_render_seconds);
+
+    char const* const size_name = "passphrase_document_size_bytes";
+    out += std::string("# HELP ") + size_name + " Size of each written document.\n# TYPE " + size_name + " histogram\n";
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i <= document_size_buckets.size(); ++i)
+    {
+      cumulative += m_document_size_counts[i];
+      char le[48];
+      if (i < document_size_buckets.size())
+        std::snprintf(le, sizeof(le), "_bucket{le=\"%.0f\"}", document_size_buckets[i]);
+      else
+        std::snprintf(le, sizeof(le), "_bucket{le=\"+Inf\"}");
+      sample(size_name + std::string(le), static_cast<double>(cumulative));
+    }
+    sample(size_name + std::string("_sum"), static_cast<double>(m_bytes_written));
+    sample(size_name + std::string("_count"), static_cast<double>(m_documents_written));
+
+    return out;
+  }
+
+private:
+  static constexpr std::size_t number_of_error_kinds = 7;
+  static constexpr std::array<double, 8> document_size_buckets = {1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216};
+
+  mutable std::mutex m_mutex;
+  std::uint64_t m_sheets_rendered = 0;
+  std::uint64_t m_documents_written = 0;
+  std::uint64_t m_bytes_written = 0;
+  std::array<std::uint64_t, number_of_error_kinds> m_errors{};
+  std::array<std::uint64_t, 2> m_compactions{};
+  std::map<std::string, std::array<std::uint64_t, 2>> m_cache_lookups;
+  std::vector<double> m_layout_seconds;
+  std::vector<double> m_render_seconds;
+  std::array<std::uint64_t, document_size_buckets.size() + 1> m_document_size_counts{};
+};
+
+Metrics g_metrics;
+
+// The diagnostic log of --verbose.
+//
+// Each thread collects what it logs in a buffer of its own. Within a LogScope
+// (an input, a sheet) everything logged stays in that buffer, and the
+// outermost scope hands it over as one record when it ends. Records pass
+// through a lock-free queue to a single writer thread that writes each with
+// one call, so nothing interleaves and the lines of a sheet stay together and
+// in order, whichever thread laid it out. While the log is off, log() returns
+// after a load and a branch; call sites test enabled() first when the
+// arguments cost anything to compute.
+struct LogBuffer
+{
+  std::string text; // Logged and not yet handed to the writer.
+  int depth = 0;    // Of nested LogScopes.
+};
+
+thread_local LogBuffer g_log_buffer;
+
+class DiagnosticLog
+{
+public:
+  DiagnosticLog() = default;
+  DiagnosticLog(DiagnosticLog const&) = delete;
+  DiagnosticLog& operator=(DiagnosticLog const&) = delete;
+
+  ~DiagnosticLog()
+  {
+    stop();
+    delete m_tail;
+  }
+
+  [[nodiscard]] bool enabled() const { return m_enabled; }
+
+  // Starts the writer thread; called before any other thread logs.
+  void start(std::FILE* file)
+  {
+    m_file = file;
+    m_enabled = true;
+    m_writer = std::thread([this]() { write_records(); });
+  }
+
+  // Writes what is left and stops the writer thread; called after all other threads are done.
+  void stop()
+  {
+    if (!m_writer.joinable())
+      return;
+    m_stopping.store(true, std::memory_order_release);
+    m_pushed.fetch_add(1, std::memory_order_release);
+    m_pushed.notify_one();
+    m_writer.join();
+  }
+
+  [[gnu::format(printf, 2, 3)]] void log(char const* format, ...)
+  {
+    if (!m_enabled)
+      return;
+
+    std::va_list args;
+    va_start(args, format);
+    std::va_list args_copy;
+    va_copy(args_copy, args);
+    int const length = std::vsnprintf(nullptr, 0, format, args);
+    va_end(args);
+    std::string& text = g_log_buffer.text;
+    if (length > 0)
+    {
+      std::size_t const size = text.size();
+      text.resize(size + static_cast<std::size_t>(length) + 1);
+      std::vsnprintf(text.data() + size, static_cast<std::size_t>(length) + 1, format, args_copy);
+      text.resize(size + static_cast<std::size_t>(length));
+    }
+    va_end(args_copy);
+
+    if (g_log_buffer.depth == 0)
+      push(std::exchange(text, {}));
+  }
+
+  void begin_scope() { ++g_log_buffer.depth; }
+
+  void end_scope()
+  {
+    if (--g_log_buffer.depth == 0 && !g_log_buffer.text.empty())
+      push(std::exchange(g_log_buffer.text, {}));
+  }
+
+private:
+  struct Record
+  {
+    std::atomic<Record*> next{nullptr};
+    std::string text;
+  };
+
+  // Vyukov's intrusive MPSC queue: producers only exchange m_head, the writer
+  // owns m_tail, a record that has been written (or the initial stub).
+  void push(std::string text)
+  {
+    Record* const record = new Record;
+    record->text = std::move(text);
+    Record* const previous = m_head.exchange(record, std::memory_order_acq_rel);
+    previous->next.store(record, std::memory_order_release);
+    m_pushed.fetch_add(1, std::memory_order_release);
+    m_pushed.notify_one();
+  }
+
+  Record* pop()
+  {
+    Record* const next = m_tail->next.load(std::memory_order_acquire);
+    if (!next)
+      return nullptr;
+    delete m_tail;
+    m_tail = next;
+    return next;
+  }
+
+  void write_records()
+  {
+    for (;;)
+    {
+      std::uint64_t const pushed = m_pushed.load(std::memory_order_acquire);
+      bool const stopping = m_stopping.load(std::memory_order_acquire);
+      while (Record* const record = pop())
+      {
+        std::fwrite(record->text.data(), 1, record->text.size(), m_file);
+        std::string().swap(record->text);
+      }
+      if (stopping)
+        return;
+      m_pushed.wait(pushed, std::memory_order_acquire);
+    }
+  }
+
+  bool m_enabled = false;
+  std::FILE* m_file = nullptr;
+  Record* m_tail = new Record;
+  std::atomic<Record*> m_head{m_tail};
+  std::atomic<std::uint64_t> m_pushed{0};
+  std::atomic<bool> m_stopping{false};
+  std::thread m_writer;
+};
+
+DiagnosticLog g_log;
+
+// Keeps what this thread logs until the end of the scope together.
+class LogScope
+{
+public:
+  LogScope()
+      : m_enabled(g_log.enabled())
+  {
+    if (m_enabled)
+      g_log.begin_scope();
+  }
+
+  LogScope(LogScope const&) = delete;
+  LogScope& operator=(LogScope const&) = delete;
+
+  ~LogScope()
+  {
+    if (m_enabled)
+      g_log.end_scope();
+  }
+
+private:
+  bool m_enabled;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+using JsonMembers = std::vector<json::object_t::value_type>;
+
+// The members of an ordered_json object as the vector they are stored in;
+// ordered_map's own insert and lookup functions search all members linearly.
+JsonMembers const& members_of(json const& object)
+{
+  return object.get_ref<json::object_t const&>();
+}
+
+// Open addressing hash index from key to position in a JsonMembers vector.
+// It stores positions only, so adding a key costs no allocation.
+class MemberIndex
+{
+public:
+  [[nodiscard]] bool empty() const { return m_slots.empty(); }
+
+  // The position of `key` in `members`, or members.size() if it is not there.
+  [[nodiscard]] std::size_t find(JsonMembers const& members, std::string_view key) const
+  {
+    std::size_t const mask = m_slots.size() - 1;
+    for (std::size_t slot = std::hash<std::string_view>{}(key) & mask;; slot = (slot + 1) & mask)
+    {
+      std::uint32_t const entry = m_slots[slot];
+      if (entry == 0)
+        return members.size();
+      if (members[entry - 1].first == key)
+        return entry - 1;
+    }
+  }
+
+  // Index members[position], which must not already be indexed under the same key.
+  void insert(JsonMembers const& members, std::size_t position)
+  {
+    if (2 * (m_count + 1) > m_slots.size())
+    {
+      m_slots.assign(std::max<std::size_t>(64, 2 * m_slots.size()), 0);
+      m_count = 0;
+      for (std::size_t i = 0; i < position; ++i)
+        place(members, i);
+    }
+    place(members, position);
+  }
+
+private:
+  void place(JsonMembers const& members, std::size_t position)
+  {
+    std::size_t const mask = m_slots.size() - 1;
+    std::size_t slot = std::hash<std::string_view>{}(members[position].first) & mask;
+    while (m_slots[slot] != 0)
+      slot = (slot + 1) & mask;
+    m_slots[slot] = static_cast<std::uint32_t>(position + 1);
+    ++m_count;
+  }
+
+  std::vector<std::uint32_t> m_slots; // Member position + 1, or 0 for an empty slot.
+  std::size_t m_count = 0;
+};
+
+// Member lookup in a (possibly huge) ordered_json object that is usually
+// queried in member order, as data and margins are by the data_headers loop:
+// the member after the previous hit is tried first and the hash index is only
+// built on the first miss.
+class ObjectIndex
+{
+public:
+  explicit ObjectIndex(json const& object)
+      : m_members(members_of(object))
+  {
+  }
+
+  [[nodiscard]] json const* find(std::string const& key)
+  {
+    std::size_t position = m_members.size();
+    if (m_next < m_members.size() && m_members[m_next].first == key)
+      position = m_next;
+    else
+    {
+      if (m_index.empty())
+        for (std::size_t i = 0; i < m_members.size(); ++i)
+          m_index.insert(m_members, i);
+      if (!m_index.empty())
+        position = m_index.find(m_members, key);
+    }
+    if (position == m_members.size())
+      return nullptr;
+    m_next = position + 1;
+    return &m_members[position].second;
+  }
+
+private:
+  JsonMembers const& m_members;
+  MemberIndex m_index;
+  std::size_t m_next = 0;
+};
+
+// --explain: one fixed size record per block, collected while packing and
+// only formatted afterwards so that tracing hardly perturbs the timings.
+enum TraceFlags : std::uint16_t
+{
+  trace_new_group = 1,            // The block started a new row group.
+  trace_height_rebuild = 2,       // RowGroup::add re-added the group at the height of this block.
+  trace_compaction_attempted = 4, // The last KEY_ID was compacted to make room for this block...
+  trace_compaction_rolled_back = 8 // ... but the group did not fit after all.
+};
+
+struct TraceRecord
+{
+  std::uint32_t block = 0;          // Index into Sheet::blocks.
+  std::uint32_t group = 0;          // Final row group of the block.
+  std::uint32_t column = 0;         // Final column within that group.
+  std::uint32_t blocks_readded = 0; // Blocks re-added by rebuilds while placing this block.
+  std::uint32_t nanoseconds = 0;    // Time spent placing this block.
+  std::uint16_t flags = 0;          // TraceFlags.
+  std::uint16_t padding = 0;
+};
+
+// What to do with a header that does not fit on one line in the width of its block (--header-fit).
+enum class HeaderFit
+{
+  flag,       // Leave it, and warn.
+  abbreviate, // Shorten it with an ellipsis.
+  widen       // Widen the block to the right as far as the table allows, then abbreviate what still does not fit.
+};
+
+enum class Orientation
+{
+  portrait,
+  landscape
+};
+
+char const* orientation_name(Orientation orientation)
+{
+  return orientation == Orientation::portrait ? "portrait" : "landscape";
+}
+
+// The table width of a sheet is given for A4 portrait; landscape has room for
+// proportionally more columns.
+int oriented_table_width(int portrait_width, Orientation orientation)
+{
+  return orientation == Orientation::portrait ? portrait_width : portrait_width * 297 / 210;
+}
+
+struct LayoutOptions
+{
+  bool explain = false;
+  HeaderFit header_fit = HeaderFit::flag;
+  Orientation orientation = Orientation::portrait;
+};
+
+// A problem with an input sheet, found while laying it out.
+struct Diagnostic
+{
+  Metrics::ErrorKind kind; // json_schema or validation.
+  std::string message;
+};
+
+struct Sheet
+{
+  std::string label;
+  std::string title_left;
+  std::string title_right;
+  int table_width = 0;
+  std::vector<Block> blocks;
+  std::vector<RowGroup> groups;
+  std::vector<TraceRecord> trace; // Only filled in with --explain.
+  std::vector<std::string_view> block_classes; // Extra CSS class of the header of each block, if not empty (diff view).
+  std::vector<std::string> warnings;            // Text that will not fit in the browser.
+  std::vector<Diagnostic> errors;               // Why the input is invalid; a sheet with errors is not laid out.
+  std::vector<Sheet> sections;                  // A sheet with sections has no blocks of its own.
+  std::vector<int> bands;                       // Per section: the band of sections side by side that it is in.
+};
+
+// Calls fn with every sheet that holds blocks: the sheet itself, or each of its sections.
+template <typename Fn>
+void for_each_table(Sheet const& sheet, Fn&& fn)
+{
+  if (sheet.sections.empty())
+    fn(sheet);
+  for (Sheet const& section : sheet.sections)
+    fn(section);
+}
+
+void layout_sections(Sheet& sheet, json const& j, LayoutOptions const& layout_options);
+
+// The optional "layout" object of a sheet constrains how its blocks are packed:
+//
+//   "keep_together": [["a", "b"], ...]  each list of blocks must end up in the same row group,
+//   "first_column": ["a", ...]          these blocks must be in the first column of their row group,
+//   "reorder": true                     blocks may be taken out of data_headers order to save rows.
+//
+// Without "reorder", keeping blocks together keeps everything between them together too.
+struct LayoutConstraints
+{
+  std::vector<std::vector<int>> keep_together; // Block indices.
+  std::vector<char> first_column;              // Per block.
+  bool reorder = false;
+};
+
+Expected<LayoutConstraints> parse_layout_constraints(json const& layout, std::vector<Block> const& blocks, std::string const& what)
+{
+  if (!layout.is_object())
+    return Unexpected{what + " must be an object"};
+
+  std::unordered_map<std::string_view, int> index;
+  for (std::size_t i = 0; i < blocks.size(); ++i)
+    index.emplace(blocks[i].key, static_cast<int>(i));
+  auto block_index = [&](json const& key, std::string const& key_what) -> Expected<int> {
+    if (!key.is_string())
+      return Unexpected{key_what + " must be a data_headers key"};
+    auto const it = index.find(key.get_ref<std::string const&>());
+    if (it == index.end())
+      return Unexpected{key_what + ": there is no block '" + key.get<std::string>() + "'"};
+    return it->second;
+  };
+
+  LayoutConstraints constraints;
+  constraints.first_column.assign(blocks.size(), 0);
+  for (auto const& [name, value] : layout.items())
+  {
+    std::string const value_what = what + "." + name;
+    if (name == "keep_together")
+    {
+      if (!value.is_array())
+        return Unexpected{value_what + " must be an array of arrays of keys"};
+      for (std::size_t i = 0; i < value.size(); ++i)
+      {
+        std::string const list_what = value_what + "[" + std::to_string(i) + "]";
+        if (!value[i].is_array())
+          return Unexpected{list_what + " must be an array of keys"};
+        std::vector<int>& list = constraints.keep_together.emplace_back();
+        for (std::size_t k = 0; k < value[i].size(); ++k)
+        {
+          Expected<int> const idx = block_index(value[i][k], list_what + "[" + std::to_string(k) + "]");
+          if (!idx)
+            return Unexpected{idx.error()};
+          list.push_back(*idx);
+        }
+      }
+    }
+    else if (name == "first_column")
+    {
+      if (!value.is_array())
+        return Unexpected{value_what + " must be an array of keys"};
+      for (std::size_t k = 0; k < value.size(); ++k)
+      {
+        Expected<int> const idx = block_index(value[k], value_what + "[" + std::to_string(k) + "]");
+        if (!idx)
+          return Unexpected{idx.error()};
+        constraints.first_column[static_cast<std::size_t>(*idx)] = 1;
+      }
+    }
+    else if (name == "reorder")
+    {
+      if (!value.is_boolean())
+        return Unexpected{value_what + " must be true or false"};
+      constraints.reorder = value.get<bool>();
+    }
+    else
+      return Unexpected{value_what + ": unknown layout constraint"};
+  }
+  return constraints;
+}
+
+// Packs the blocks of a sheet under its layout constraints, into row groups of
+// minimal total height.
+//
+// Blocks that must stay together are merged into units first, so the search
+// never considers splitting them. In data_headers order the only choice left
+// is where to start new row groups, which a dynamic program over the units
+// decides exactly. With "reorder", a branch and bound search also picks the
+// order; it is seeded with that in-order packing, prunes every branch whose
+// area bound cannot beat the best packing found so far, and tries only one of
+// several interchangeable units (same size, same constraints). The search
+// gives up after pack_node_budget nodes and keeps the best packing found.
+//
+// Unlike the greedy flow of layout_sheet, this never compacts KEY_IDs.
+class ConstrainedPacker
+{
+public:
+  static constexpr int pack_node_budget = 50000;
+
+  ConstrainedPacker(std::vector<Block> const& blocks, int table_width, LayoutConstraints const& constraints,
+                    std::string const& sheet_label)
+      : m_table_width(table_width)
+      , m_first_column(constraints.first_column)
+  {
+    make_units(blocks, constraints);
+    for (Unit const& unit : m_units)
+    {
+      RowGroup group(table_width);
+      if (!add_unit(group, unit) || !pins_hold(group))
+      {
+        m_unfit = sheet_label + ": block '" + blocks[static_cast<std::size_t>(unit.blocks.front())].key +
+                  "' and the blocks it is kept together with do not fit in one row group";
+        break;
+      }
+    }
+  }
+
+  Expected<std::vector<RowGroup>> pack(bool reorder)
+  {
+    if (!m_unfit.empty())
+      return Unexpected{m_unfit};
+    std::vector<int> order(m_units.size());
+    for (std::size_t i = 0; i < order.size(); ++i)
+      order[i] = static_cast<int>(i);
+    break_into_groups(order);
+    if (reorder)
+      search();
+    if (m_best_height == no_packing)
+      return Unexpected{"the layout constraints cannot all be met"};
+    return std::move(m_best);
+  }
+
+  [[nodiscard]] int nodes() const { return m_nodes; }
+  [[nodiscard]] std::size_t units() const { return m_units.size(); }
+
+private:
+  static constexpr int no_packing = std::numeric_limits<int>::max();
+
+  struct Unit
+  {
+    std::vector<int> blocks; // In data_headers order.
+    int area = 0;
+    int shape = 0; // Units of the same shape are interchangeable.
+  };
+
+  void make_units(std::vector<Block> const& blocks, LayoutConstraints const& constraints)
+  {
+    int const n = static_cast<int>(blocks.size());
+    std::vector<int> parent(static_cast<std::size_t>(n));
+    for (int i = 0; i < n; ++i)
+      parent[static_cast<std::size_t>(i)] = i;
+    auto find = [&](int i) {
+      while (parent[static_cast<std::size_t>(i)] != i)
+        i = parent[static_cast<std::size_t>(i)] = parent[static_cast<std::size_t>(parent[static_cast<std::size_t>(i)])];
+      return i;
+    };
+    auto unite = [&](int a, int b) { parent[static_cast<std::size_t>(find(a))] = find(b); };
+
+    for (std::vector<int> const& list : constraints.keep_together)
+      for (std::size_t k = 1; k < list.size(); ++k)
+        unite(list[k - 1], list[k]);
+    if (!constraints.reorder)
+    {
+      // Everything between the first and the last block of a set stays with it.
+      std::vector<int> last(static_cast<std::size_t>(n), -1);
+      for (int i = 0; i < n; ++i)
+        last[static_cast<std::size_t>(find(i))] = i;
+      for (int i = 0, end = -1; i < n; ++i)
+      {
+        if (i <= end)
+          unite(i, i - 1);
+        end = std::max(end, last[static_cast<std::size_t>(find(i))]);
+      }
+    }
+
+    std::vector<int> unit_of(static_cast<std::size_t>(n), -1);
+    std::map<std::array<int, 3>, int> shapes;
+    for (int i = 0; i < n; ++i)
+    {
+      int& u = unit_of[static_cast<std::size_t>(find(i))];
+      if (u == -1)
+      {
+        u = static_cast<int>(m_units.size());
+        m_units.emplace_back();
+      }
+      Block const& b = blocks[static_cast<std::size_t>(i)];
+      m_units[static_cast<std::size_t>(u)].blocks.push_back(i);
+      m_units[static_cast<std::size_t>(u)].area += b.width * b.height;
+    }
+    for (Unit& unit : m_units)
+    {
+      Block const& b = blocks[static_cast<std::size_t>(unit.blocks.front())];
+      unit.shape = static_cast<int>(shapes.size());
+      if (unit.blocks.size() == 1)
+        unit.shape = shapes.emplace(std::array<int, 3>{b.width, b.height, m_first_column[static_cast<std::size_t>(unit.blocks.front())]}, unit.shape).first->second;
+      else
+        shapes.emplace(std::array<int, 3>{-1, static_cast<int>(&unit - m_units.data()), 0}, unit.shape);
+    }
+  }
+
+  static bool add_unit(RowGroup& group, Unit const& unit)
+  {
+    for (int const idx : unit.blocks)
+      if (!group.add(idx))
+        return false;
+    return true;
+  }
+
+  bool pins_hold(RowGroup const& group) const
+  {
+    auto const& columns = group.columns();
+    for (std::size_t c = 1; c < columns.size(); ++c)
+      for (int const idx : columns[c].blocks)
+        if (m_first_column[static_cast<std::size_t>(idx)])
+          return false;
+    return true;
+  }
+
+  // The best places to start new row groups, with the units in this order.
+  void break_into_groups(std::vector<int> const& order)
+  {
+    std::size_t const n = order.size();
+    std::vector<int> height(n + 1, no_packing);
+    std::vector<std::size_t> next(n + 1, n);
+    height[n] = 0;
+    for (std::size_t i = n; i-- > 0;)
+    {
+      RowGroup group(m_table_width);
+      for (std::size_t j = i; j < n; ++j)
+      {
+        if (!add_unit(group, m_units[static_cast<std::size_t>(order[j])]))
+          break;
+        // Prefer fewer, fuller row groups when the height is the same.
+        if (height[j + 1] != no_packing && pins_hold(group) && group.height() + height[j + 1] <= height[i])
+        {
+          height[i] = group.height() + height[j + 1];
+          next[i] = j + 1;
+        }
+      }
+    }
+    if (height[0] >= m_best_height)
+      return;
+
+    m_best_height = height[0];
+    m_best.clear();
+    for (std::size_t i = 0; i < n; i = next[i])
+    {
+      m_best.emplace_back(m_table_width);
+      for (std::size_t j = i; j < next[i]; ++j)
+        add_unit(m_best.back(), m_units[static_cast<std::size_t>(order[j])]);
+    }
+  }
+
+  void search()
+  {
+    // The units of each shape, in data_headers order; units of a shape are always taken in that order.
+    std::size_t const shape_count = m_units.empty() ? 0 : static_cast<std::size_t>(
+        std::max_element(m_units.begin(), m_units.end(), [](Unit const& a, Unit const& b) { return a.shape < b.shape; })->shape + 1);
+    m_by_shape.assign(shape_count, {});
+    for (std::size_t u = 0; u < m_units.size(); ++u)
+      m_by_shape[static_cast<std::size_t>(m_units[u].shape)].push_back(static_cast<int>(u));
+    m_taken.assign(shape_count, 0);
+
+    int remaining_area = 0;
+    for (Unit const& unit : m_units)
+      remaining_area += unit.area;
+    std::vector<RowGroup> closed;
+    search(closed, 0, RowGroup(m_table_width), 0, remaining_area);
+  }
+
+  void search(std::vector<RowGroup>& closed, int closed_height, RowGroup const& group, int group_area, int remaining_area)
+  {
+    if (++m_nodes > pack_node_budget)
+      return;
+    if (remaining_area == 0)
+    {
+      if (closed_height + group.height() < m_best_height)
+      {
+        m_best_height = closed_height + group.height();
+        m_best = closed;
+        m_best.push_back(group);
+      }
+      return;
+    }
+    // However the rest is packed, it needs at least its area in rows.
+    int const bound = closed_height + std::max(group.height(), (group_area + remaining_area + m_table_width - 1) / m_table_width);
+    if (bound >= m_best_height)
+      return;
+
+    for (std::size_t s = 0; s < m_by_shape.size(); ++s)
+    {
+      if (m_taken[s] == m_by_shape[s].size())
+        continue;
+      Unit const& unit = m_units[static_cast<std::size_t>(m_by_shape[s][m_taken[s]])];
+      RowGroup extended = group;
+      if (!add_unit(extended, unit) || !pins_hold(extended))
+        continue;
+      ++m_taken[s];
+      search(closed, closed_height, extended, group_area + unit.area, remaining_area - unit.area);
+      --m_taken[s];
+    }
+    if (!group.empty())
+    {
+      closed.push_back(group);
+      search(closed, closed_height + group.height(), RowGroup(m_table_width), 0, remaining_area);
+      closed.pop_back();
+    }
+  }
+
+  int m_table_width;
+  std::vector<char> const& m_first_column;
+  std::vector<Unit> m_units;
+  std::vector<std::vector<int>> m_by_shape;
+  std::vector<std::size_t> m_taken;
+  std::vector<RowGroup> m_best;
+  int m_best_height = no_packing;
+  int m_nodes = 0;
+  std::string m_unfit; // Why a unit does not fit in a row group on its own, if one does not.
+};
+
+// The member `key` of `object`, or null if `object` is null, not an object or has no such member.
+json const* find_member(json const* object, std::string const& key)
+{
+  if (!object || !object->is_object())
+    return nullptr;
+  auto const it = object->find(key);
+  return it == object->end() ? nullptr : &*it;
+}
+
+// The block `key` of a sheet, from its data_headers entry and its entries in
+// data and margins, which may be missing. Every problem found is added to
+// sheet.errors, and then there is no block. The width of the block is only
+// checked against a valid (non-zero) sheet.table_width.
+std::optional<Block> make_block(Sheet& sheet, std::string const& key, json const& header_value, json const* data_entry,
+                                json const* margin_entry, HeaderFit header_fit)
+{
+  std::string const& sheet_label = sheet.label;
+  int const table_width = sheet.table_width;
+  auto schema_error = [&](std::string message) { sheet.errors.push_back({Metrics::ErrorKind::json_schema, std::move(message)}); };
+  auto error = [&](std::string message) { sheet.errors.push_back({Metrics::ErrorKind::validation, std::move(message)}); };
+
+  // Check everything about the block before giving up on it, so that one run reports all problems.
+  std::size_t const errors_before = sheet.errors.size();
+  if (!data_entry)
+    error(sheet_label + ": data_headers key '" + key + "' is missing from data");
+  if (!margin_entry)
+    error(sheet_label + ": data_headers key '" + key + "' is missing from margins");
+  if (!header_value.is_string())
+    schema_error(sheet_label + ".data_headers." + key + " must be a string");
+  if (data_entry && !data_entry->is_string())
+    schema_error(sheet_label + ".data." + key + " must be a string");
+  if (margin_entry && !margin_entry->is_object())
+    error(sheet_label + ".margins." + key + " must be an object");
+  if (sheet.errors.size() != errors_before)
+    return std::nullopt;
+
+  std::string const header = header_value.get<std::string>();
+  std::string const data_value = data_entry->get<std::string>();
+  json const& margin_obj = *margin_entry;
+
+  auto margin = [&](std::string const& side) {
+    json const* const value = find_member(&margin_obj, side);
+    if (!value)
+      return 0;
+    Expected<int> const parsed = parse_int(*value, sheet_label + ".margins." + key + "." + side);
+    if (!parsed)
+      error(parsed.error());
+    return parsed ? *parsed : 0;
+  };
+  int const margin_left = margin("left");
+  int margin_right = margin("right");
+
+  int content_width = (key == "keyid") ? 18 : ((key == "keyid3") ? 10 : data_width(data_value));
+  int height = (key == "keyid") ? 2 : ((key == "keyid3") ? 3 : data_height(data_value));
+  std::string keyid_hex16;
+  if (key == "keyid" || key == "keyid3")
+  {
+    Expected<std::string> parsed = parse_keyid_hex16(data_value);
+    if (parsed)
+      keyid_hex16 = std::move(*parsed);
+    else
+      error(parsed.error());
+  }
+
+  int width = content_width + margin_left + margin_right;
+
+  if (table_width > 0 && width > table_width)
+    error(sheet_label + ": block '" + key + "' has width " + std::to_string(width) + " > table width " + std::to_string(table_width));
+  if (sheet.errors.size() != errors_before)
+    return std::nullopt;
+
+  int header_extra = 0;
+  if (header_fit == HeaderFit::widen)
+  {
+    int const needed = header_cells_needed(header);
+    if (needed > content_width)
+    {
+      header_extra = std::min(needed - content_width, table_width - margin_left - content_width);
+      margin_right = std::max(margin_right, header_extra);
+      width = content_width + margin_left + margin_right;
+    }
+  }
+
+  Block block;
+  block.key = key;
+  block.header = header;
+  block.data = data_value;
+  block.keyid_hex16 = keyid_hex16;
+  block.width = width;
+  block.content_width = content_width;
+  block.height = height;
+  block.margin_left = margin_left;
+  block.margin_right = margin_right;
+  block.header_extra = header_extra;
+  block.keyid_compact = key == "keyid3";
+  return block;
+}
+
+// The greedy flow of layout_sheet: blocks are placed one at a time, in
+// data_headers order, in the current row group if they fit there (after
+// compacting a KEY_ID at its end, if that makes room), or else in a new one.
+// At the start of a row group the whole state is the row groups closed before
+// it, so packing can be resumed there after a change to a later block (see
+// SheetEditor).
+class GreedyPacker
+{
+public:
+  GreedyPacker(std::vector<RowGroup>& groups, int table_width)
+      : m_groups(groups)
+      , m_current(table_width)
+      , m_table_width(table_width)
+  {
+  }
+
+  // Places the block, which must fit in an empty row group; returns whether it starts a new one.
+  bool place(int block_index)
+  {
+    bool const starts_group = m_current.empty();
+    if (m_current.add(block_index))
+      return starts_group;
+
+    if (try_compact_last_keyid_to_fit(block_index))
+      return false;
+
+    if (!m_current.empty())
+      m_groups.push_back(std::move(m_current));
+
+    ++g_layout_counters.groups;
+    m_current = RowGroup(m_table_width);
+    if (!m_current.add(block_index))
+      throw InternalError("internal error: failed to start new RowGroup");
+    return true;
+  }
+
+  // Closes the current row group.
+  void finish()
+  {
+    if (!m_current.empty())
+      m_groups.push_back(std::move(m_current));
+    m_current = RowGroup(m_table_width);
+  }
+
+private:
+  bool try_compact_last_keyid_to_fit(int new_block_index)
+  {
+    if (m_current.empty())
+      return false;
+    if (!m_current.last_column_has_single_block())
+      return false;
+
+    int const keyid_index = m_current.last_block_index();
+    Block const& keyid = get_block(keyid_index);
+    if (keyid.key != "keyid" || keyid.keyid_compact)
+      return false;
+    if (m_current.last_column().width != keyid.width)
+      return false;
+
+    Block const saved = keyid;
+    Block& keyid_mut = get_block_mut(keyid_index);
+
+    int const shrink = 8;
+    if (keyid_mut.content_width < shrink + 2)
+      return false;
+    keyid_mut.keyid_compact = true;
+    keyid_mut.content_width -= shrink;
+    keyid_mut.width -= shrink;
+    keyid_mut.height = 3;
+    ++g_layout_counters.compaction_attempts;
+
+    RowGroup rebuilt(m_table_width);
+    for (auto const& col : m_current.columns())
+    {
+      for (int const idx : col.blocks)
+      {
+        if (!rebuilt.add(idx))
+        {
+          keyid_mut = saved;
+          ++g_layout_counters.compaction_rollbacks;
+          return false;
+        }
+      }
+    }
+    if (!rebuilt.add(new_block_index))
+    {
+      keyid_mut = saved;
+      ++g_layout_counters.compaction_rollbacks;
+      return false;
+    }
+
+    m_current = std::move(rebuilt);
+    return true;
+  }
+
+  std::vector<RowGroup>& m_groups;
+  RowGroup m_current;
+  int m_table_width;
+};
+
+// The warning for a title that does not fit in the width of its table.
+constexpr std::string_view title_too_wide = "the title is wider than the table and will stretch it";
+
+bool title_fits(Sheet const& sheet)
+{
+  return text_fits(liberation_sans, sheet.title_left + "  " + sheet.title_right, title_font_px, sheet.table_width * cell_width_px);
+}
+
+// Lays out one sheet. Problems with the input do not stop at the first one:
+// every block is checked, and all problems found end up in Sheet::errors.
+Sheet layout_sheet(json const& j, std::string const& sheet_label, LayoutOptions const& layout_options = {})
+{
+  LogScope const _log_scope;
+  auto const log_start = g_log.enabled() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+  bool const explain = layout_options.explain;
+  Sheet sheet;
+  sheet.label = sheet_label;
+  auto schema_error = [&](std::string message) { sheet.errors.push_back({Metrics::ErrorKind::json_schema, std::move(message)}); };
+  auto error = [&](std::string message) { sheet.errors.push_back({Metrics::ErrorKind::validation, std::move(message)}); };
+  auto string_member = [&](json const* object, std::string const& key, std::string const& what) -> std::string {
+    json const* const value = find_member(object, key);
+    if (value && value->is_string())
+      return value->get<std::string>();
+    schema_error(what + (value ? " must be a string" : " is missing"));
+    return {};
+  };
+
+  json const* const title = find_member(&j, "title");
+  sheet.title_left = string_member(title, "left", sheet_label + ".title.left");
+  sheet.title_right = string_member(title, "right", sheet_label + ".title.right");
+  if (json const* const width = find_member(find_member(&j, "table"), "width"))
+  {
+    Expected<int> const parsed = parse_int(*width, sheet_label + ".table.width");
+    if (!parsed)
+      error(parsed.error());
+    else if (*parsed <= 0)
+      error(sheet_label + ".table.width must be positive");
+    else
+      sheet.table_width = oriented_table_width(*parsed, layout_options.orientation);
+  }
+  else
+    schema_error(sheet_label + ".table.width is missing");
+  int const table_width = sheet.table_width;
+
+  if (j.contains("sections"))
+  {
+    if (sheet.errors.empty())
+      layout_sections(sheet, j, layout_options);
+    return sheet;
+  }
+
+  json const* const headers_member = find_member(&j, "data_headers");
+  json const* const data_member = find_member(&j, "data");
+  json const* const margins_member = find_member(&j, "margins");
+  bool members_valid = true;
+  for (auto const& [member, name] : {std::pair{headers_member, "data_headers"}, {data_member, "data"}, {margins_member, "margins"}})
+  {
+    if (!member)
+      schema_error(sheet_label + "." + name + " is missing");
+    else if (!member->is_object())
+      error(sheet_label + "." + name + " must be an object");
+    members_valid = members_valid && member && member->is_object();
+  }
+  if (!members_valid)
+    return sheet;
+  json const& headers = *headers_member;
+
+  ObjectIndex data_index(*data_member);
+  ObjectIndex margins_index(*margins_member);
+
+  std::vector<Block>& blocks = sheet.blocks;
+  blocks.reserve(headers.size());
+  BlocksScope const _blocks_scope(blocks);
+
+  std::vector<RowGroup>& groups = sheet.groups;
+  GreedyPacker packer(groups, table_width);
+  json const* const layout = find_member(&j, "layout");
+
+  for (auto const& [key, header_value] : headers.items())
+  {
+    std::optional<Block> block = make_block(sheet, key, header_value, data_index.find(key), margins_index.find(key),
+                                            layout_options.header_fit);
+    if (!block)
+      continue;
+    blocks.push_back(std::move(*block));
+    int const block_index = static_cast<int>(blocks.size() - 1);
+    if (layout || !sheet.errors.empty())
+      continue;
+
+    if (!explain)
+    {
+      packer.place(block_index);
+      continue;
+    }
+
+    LayoutCounters const before = g_layout_counters;
+    auto const start = std::chrono::steady_clock::now();
+    bool const new_group = packer.place(block_index);
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    TraceRecord record;
+    record.block = static_cast<std::uint32_t>(block_index);
+    record.blocks_readded = static_cast<std::uint32_t>(g_layout_counters.blocks_readded - before.blocks_readded);
+    record.nanoseconds = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    if (new_group)
+      record.flags |= trace_new_group;
+    if (g_layout_counters.rebuilds != before.rebuilds)
+      record.flags |= trace_height_rebuild;
+    if (g_layout_counters.compaction_attempts != before.compaction_attempts)
+      record.flags |= trace_compaction_attempted;
+    if (g_layout_counters.compaction_rollbacks != before.compaction_rollbacks)
+      record.flags |= trace_compaction_rolled_back;
+    sheet.trace.push_back(record);
+  }
+
+  if (!sheet.errors.empty())
+  {
+    groups.clear();
+    return sheet;
+  }
+
+  if (layout)
+  {
+    auto const start = std::chrono::steady_clock::now();
+    Expected<LayoutConstraints> const constraints = parse_layout_constraints(*layout, blocks, sheet_label + ".layout");
+    if (!constraints)
+    {
+      error(constraints.error());
+      return sheet;
+    }
+    ConstrainedPacker packer(blocks, table_width, *constraints, sheet_label);
+    Expected<std::vector<RowGroup>> packed = packer.pack(constraints->reorder);
+    if (!packed)
+    {
+      error(packed.error());
+      return sheet;
+    }
+    groups = std::move(*packed);
+    g_layout_counters.groups += groups.size();
+    if (g_log.enabled())
+    {
+      g_log.log("%s: constrained packing of %zu units searched %d nodes%s\n", sheet_label.c_str(), packer.units(), packer.nodes(),
+                packer.nodes() > ConstrainedPacker::pack_node_budget ? ", the whole budget" : "");
+    }
+    if (explain)
+    {
+      // The packer places whole units, not blocks one by one: charge its time to the block that opens each row group.
+      auto const elapsed = std::chrono::steady_clock::now() - start;
+      sheet.trace.resize(blocks.size());
+      for (std::size_t i = 0; i < blocks.size(); ++i)
+        sheet.trace[i].block = static_cast<std::uint32_t>(i);
+      for (RowGroup const& group : groups)
+      {
+        TraceRecord& record = sheet.trace[static_cast<std::size_t>(group.columns().front().blocks.front())];
+        record.flags |= trace_new_group;
+        record.nanoseconds = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+                                                        static_cast<std::int64_t>(groups.size()));
+      }
+    }
+  }
+  else
+    packer.finish();
+
+  // Only now are the widths final: compacting a KEY_ID makes its header narrower.
+  for (Block& block : blocks)
+  {
+    int const cells = block.content_width + block.header_extra;
+    if (text_fits(dejavu_sans, block.header, header_font_px, cells * cell_width_px - cell_chrome_px))
+      continue;
+    if (layout_options.header_fit == HeaderFit::flag)
+    {
+      sheet.warnings.push_back("header '" + block.header + "' of block '" + block.key + "' needs " +
+                               std::to_string(header_cells_needed(block.header)) + " columns but has " + std::to_string(cells) +
+                               "; it will wrap and make the row taller");
+    }
+    else
+      block.header = abbreviate_header(block.header, cells);
+  }
+  if (!title_fits(sheet))
+    sheet.warnings.emplace_back(title_too_wide);
+
+  if (explain)
+  {
+    // Later rebuilds can still move a block, so record where each one finally ended up.
+    for (std::size_t g = 0; g < groups.size(); ++g)
+    {
+      auto const& columns = groups[g].columns();
+      for (std::size_t c = 0; c < columns.size(); ++c)
+      {
+        for (int const idx : columns[c].blocks)
+        {
+          sheet.trace[static_cast<std::size_t>(idx)].group = static_cast<std::uint32_t>(g);
+          sheet.trace[static_cast<std::size_t>(idx)].column = static_cast<std::uint32_t>(c);
+        }
+      }
+    }
+  }
+
+  if (g_log.enabled())
+  {
+    int rows = 0;
+    for (RowGroup const& group : groups)
+      rows += group.height();
+    g_log.log("%s: %s layout of %zu blocks: %zu row groups, %d rows, %.3f ms\n", sheet_label.c_str(),
+              orientation_name(layout_options.orientation), blocks.size(), groups.size(), rows, seconds_since(log_start) * 1e3);
+  }
+  return sheet;
+}
+
+// A sheet with "sections" holds several independent tables, each with its own
+// title, table width and blocks: a section has the same form as a sheet. The
+// sections are laid out concurrently when they are large enough to be worth a
+// thread, then placed in bands, left to right for as long as they fit in the
+// table width of the sheet with section_gap columns between them, and stacked
+// otherwise.
+constexpr int section_gap = 1;
+
+// A section lays out in microseconds: starting a thread only pays off for about this many blocks.
+constexpr std::size_t section_blocks_per_worker = 2000;
+
+void layout_sections(Sheet& sheet, json const& j, LayoutOptions const& layout_options)
+{
+  std::string const what = sheet.label + ".sections";
+  auto error = [&](std::string message) { sheet.errors.push_back({Metrics::ErrorKind::validation, std::move(message)}); };
+  json const& sections = j.at("sections");
+  if (j.contains("data_headers"))
+    error(sheet.label + ": a sheet with sections has no data_headers of its own");
+  if (!sections.is_array() || sections.empty())
+  {
+    error(what + " must be a non-empty array");
+    return;
+  }
+  for (std::size_t i = 0; i < sections.size(); ++i)
+  {
+    if (sections[i].is_object() && sections[i].contains("sections"))
+      error(what + "[" + std::to_string(i) + "]: sections cannot be nested");
+  }
+  if (!sheet.errors.empty())
+    return;
+
+  sheet.sections.resize(sections.size());
+  std::size_t blocks = 0;
+  for (json const& section : sections)
+  {
+    if (json const* const headers = find_member(&section, "data_headers"); headers && headers->is_object())
+      blocks += headers->size();
+  }
+  std::size_t const workers = std::clamp<std::size_t>(blocks / section_blocks_per_worker, 1,
+                                                      std::min<std::size_t>(sections.size(), std::max(1u, std::thread::hardware_concurrency())));
+  auto lay_out = [&](std::size_t first) {
+    for (std::size_t i = first; i < sections.size(); i += workers)
+      sheet.sections[i] = layout_sheet(sections[i], what + "[" + std::to_string(i) + "]", layout_options);
+  };
+  std::vector<std::future<LayoutCounters>> others;
+  for (std::size_t w = 1; w < workers; ++w)
+  {
+    others.push_back(std::async(std::launch::async, [&, w]() {
+      g_layout_counters = LayoutCounters{};
+      lay_out(w);
+      return g_layout_counters;
+    }));
+  }
+  lay_out(0);
+  for (auto& other : others)
+    g_layout_counters += other.get();
+
+  // The errors of the sections are those of the sheet; their messages name the section.
+  for (Sheet const& section : sheet.sections)
+  {
+    sheet.errors.insert(sheet.errors.end(), section.errors.begin(), section.errors.end());
+    if (section.errors.empty() && section.table_width > sheet.table_width)
+    {
+      error(section.label + ": table width " + std::to_string(section.table_width) + " > table width " +
+            std::to_string(sheet.table_width) + " of the sheet");
+    }
+  }
+  if (!sheet.errors.empty())
+    return;
+
+  int band = 0;
+  int band_width = 0;
+  for (Sheet const& section : sheet.sections)
+  {
+    if (band_width > 0 && band_width + section_gap + section.table_width > sheet.table_width)
+    {
+      ++band;
+      band_width = 0;
+    }
+    band_width += (band_width > 0 ? section_gap : 0) + section.table_width;
+    sheet.bands.push_back(band);
+  }
+  if (g_log.enabled())
+    g_log.log("%s: %zu sections laid out on %zu threads, in %d bands\n", sheet.label.c_str(), sections.size(), workers, band + 1);
+}
+
+// The placement IR of a laid out sheet: the table cell at which each block
+// starts; its size is the width and height of the Block.
+struct Placement
+{
+  int block = 0; // Index into Sheet::blocks.
+  int top = 0;
+  int left = 0;
+};
+
+// Appends the placements of the blocks of a row group that starts at table row `group_top`.
+void append_group_placements(std::vector<Placement>& placements, std::vector<Block> const& blocks, RowGroup const& group, int group_top)
+{
+  int col_left = 0;
+  for (auto const& col : group.columns())
+  {
+    int col_top = group_top;
+    for (int const idx : col.blocks)
+    {
+      placements.push_back({idx, col_top, col_left});
+      col_top += blocks[static_cast<std::size_t>(idx)].height;
+    }
+    col_left += col.width;
+  }
+}
+
+// The placements of all blocks, in the order in which they are laid out (row group, column, top to bottom).
+std::vector<Placement> compute_placements(Sheet const& sheet)
+{
+  std::vector<Placement> placements;
+  placements.reserve(sheet.blocks.size());
+
+  int group_top = 0;
+  for (RowGroup const& group : sheet.groups)
+  {
+    append_group_placements(placements, sheet.blocks, group, group_top);
+    group_top += group.height();
+  }
+  return placements;
+}
+
+// Page model for estimating page counts: an A4 portrait page, printed from
+// Firefox at 90% with default margins, holds about this many 24 px table rows,
+// and a landscape page 210/297 of that. The title of each sheet and the
+// margin below its table take up title_rows.
+constexpr int page_rows_portrait = 44;
+constexpr int page_rows_landscape = 31;
+constexpr int title_rows = 2;
+
+int page_rows(Orientation orientation)
+{
+  return orientation == Orientation::portrait ? page_rows_portrait : page_rows_landscape;
+}
+
+int sheet_rows(Sheet const& sheet)
+{
+  int rows = title_rows;
+  for (RowGroup const& group : sheet.groups)
+    rows += group.height();
+  if (!sheet.sections.empty())
+  {
+    std::vector<int> band_rows(static_cast<std::size_t>(sheet.bands.back() + 1));
+    for (std::size_t i = 0; i < sheet.sections.size(); ++i)
+    {
+      int& band = band_rows[static_cast<std::size_t>(sheet.bands[i])];
+      band = std::max(band, sheet_rows(sheet.sections[i]));
+    }
+    for (int const band : band_rows)
+      rows += band;
+  }
+  return rows;
+}
+
+int page_count(std::vector<Sheet> const& sheets, int page_rows)
+{
+  int rows = 0;
+  for (Sheet const& sheet : sheets)
+    rows += sheet_rows(sheet);
+  return std::max(1, (rows + page_rows - 1) / page_rows);
+}
+
+// With --copies and --nup: every sheet is printed `copies` times, the copies
+// of a sheet one after the other, and `nup` copies share a page in a grid of
+// slots with cut marks between them.
+struct Imposition
+{
+  int copies = 1;
+  int nup = 1;
+  Orientation orientation = Orientation::portrait; // Of the page that the slots divide.
+
+  bool enabled() const
+  {
+    return copies > 1 || nup > 1;
+  }
+
+  // Slot columns and rows: sheets are usually wider than high, so the copies
+  // are stacked on a portrait page, in two columns from four up.
+  std::array<int, 2> grid() const
+  {
+    int const across = nup >= 4 ? 2 : 1;
+    int const down = (nup + across - 1) / across;
+    if (orientation == Orientation::portrait)
+      return {across, down};
+    return {down, across};
+  }
+};
+
+// The printable area of a page in CSS px under the page model above: 24 px rows, 210 by 297.
+std::array<int, 2> page_size_px(Orientation orientation)
+{
+  int const long_side = page_rows_portrait * 24;
+  int const short_side = long_side * 210 / 297;
+  if (orientation == Orientation::portrait)
+    return {short_side, long_side};
+  return {long_side, short_side};
+}
+
+// The zoom in percent that fits a sheet into a slot of an N-up page; sheets are only ever scaled down.
+int imposition_zoom_percent(Sheet const& sheet, Imposition const& imposition)
+{
+  auto const [columns, rows] = imposition.grid();
+  auto const [page_width, page_height] = page_size_px(imposition.orientation);
+  // Leave room around each copy for the cut lines.
+  double const slot_width = page_width / columns - 16;
+  double const slot_height = page_height / rows - 16;
+  double const zoom = std::min({1.0, slot_width / (sheet.table_width * cell_width_px), slot_height / (sheet_rows(sheet) * 24)});
+  return std::max(1, static_cast<int>(zoom * 100));
+}
+
+void print_sheet_layout(std::string& out, Sheet const& sheet)
+{
+  out += sheet.label + ".title.left: " + sheet.title_left + "\n";
+  out += sheet.label + ".title.right: " + sheet.title_right + "\n";
+  out += sheet.label + ".table.width: " + std::to_string(sheet.table_width) + "\n\n";
+  for (std::size_t i = 0; i < sheet.sections.size(); ++i)
+  {
+    out += sheet.sections[i].label + ".band: " + std::to_string(sheet.bands[i]) + "\n";
+    print_sheet_layout(out, sheet.sections[i]);
+    out += "\n";
+  }
+
+  for (Placement const& p : compute_placements(sheet))
+  {
+    Block const& b = sheet.blocks[static_cast<std::size_t>(p.block)];
+    out += b.key + ": header='" + b.header + "' data='" + b.data + "' top=" + std::to_string(p.top) + " left=" + std::to_string(p.left) +
+           " width=" + std::to_string(b.width) + " height=" + std::to_string(b.height);
+    if (b.key == "keyid")
+      out += b.keyid_compact ? " compact=1" : " compact=0";
+    out += "\n";
+  }
+}
+
+// The title of a sheet (h1) or section (h2).
+void write_title_html(std::string& output, HtmlDialect const& html, Sheet const& sheet, char level)
+{
+  if (html.minified)
+  {
+    output += "<h";
+    output += level;
+    output += " class=title><span>";
+    append_html_escaped(output, sheet.title_left);
+    output += "</span><span>";
+    append_html_escaped(output, sheet.title_right);
+    output += "</span></h";
+    output += level;
+    output += '>';
+  }
+  else
+  {
+    output += "<h";
+    output += level;
+    output += " class=\"title\">\n";
+    output += "  <span>";
+    append_html_escaped(output, sheet.title_left);
+    output += "</span>\n";
+    output += "  <span>";
+    append_html_escaped(output, sheet.title_right);
+    output += "</span>\n";
+    output += "</h";
+    output += level;
+    output += ">\n";
+  }
+}
+
+void write_table_html(std::string& output, Sheet const& sheet, HtmlDialect const& html, OutputFile* sink)
+{
+  BlocksScope const _blocks_scope(sheet.blocks);
+  int const table_width = sheet.table_width;
+
+  if (html.minified)
+  {
+    output += "<table><colgroup span=";
+    append_int(output, table_width);
+    output += " width=25>";
+  }
+  else
+  {
+    output += "<table cellspacing=\"0\" border=\"0\">\n";
+    output += "\t<colgroup span=\"";
+    append_int(output, table_width);
+    output += "\" width=\"25\"></colgroup>\n";
+  }
+
+  std::vector<ColumnCursor> cursors;
+
+  for (RowGroup const& group : sheet.groups)
+  {
+    auto const& columns = group.columns();
+    cursors.assign(columns.size(), ColumnCursor{});
+    for (int row_offset = 0; row_offset < group.height(); ++row_offset)
+    {
+      // Rows are visited in order, so each column only ever has to step to its next block.
+      for (std::size_t c = 0; c < columns.size(); ++c)
+      {
+        auto const& col = columns[c];
+        ColumnCursor& cursor = cursors[c];
+        while (cursor.position < col.blocks.size() && row_offset >= cursor.top + get_block(col.blocks[cursor.position]).height)
+          cursor.top += get_block(col.blocks[cursor.position++]).height;
+      }
+
+      if (!g_generic_rows)
+      {
+        std::string_view const row = specialized_row(html.minified, table_width, columns, cursors, row_offset);
+        if (!row.empty())
+        {
+          output += row;
+          continue;
+        }
+      }
+
+      // The minified dialect leaves the grid cells of a row empty when they all belong to full grid36
+      // rows (class a) or all to grid10 rows (class b); sheet.css then numbers them with a counter.
+      // A row without grid cells (class c) has its data cells styled by the row instead of a class each.
+      HtmlDialect row_html = html;
+      std::string_view row_open = html.row_open;
+      if (html.minified)
+      {
+        char row_class = 0;
+        for (std::size_t c = 0; c < columns.size(); ++c)
+        {
+          if (cursors[c].position == columns[c].blocks.size())
+            continue;
+          Block const& block = get_block(columns[c].blocks[cursors[c].position]);
+          int const block_row = row_offset - cursors[c].top;
+          char kind = 0;
+          if (block_row == 0)
+            continue;
+          else if (block.key == "keyid" || block.key == "keyid3")
+            kind = 'c';
+          else if (block.data == "grid10")
+            kind = 'b';
+          else if (block.data == "grid36")
+            kind = (block_row - 1) % 5 < 4 ? 'a' : '?'; // The separator rows have a labeled "-" cell.
+          else
+            kind = 'c';
+          row_class = (row_class == 0 || row_class == kind) ? kind : '?';
+        }
+        if (row_class == 'a' || row_class == 'b')
+        {
+          row_open = row_class == 'a' ? "<tr class=a>" : "<tr class=b>";
+          row_html.grid_labels = false;
+        }
+        else if (row_class == 'c')
+        {
+          row_open = "<tr class=c>";
+          row_html.data_open = "<td";
+        }
+      }
+
+      output += row_open;
+
+      int used_width = 0;
+      for (std::size_t c = 0; c < columns.size(); ++c)
+      {
+        auto const& col = columns[c];
+        ColumnCursor const& cursor = cursors[c];
+        if (cursor.position < col.blocks.size())
+        {
+          int const block_index = col.blocks[cursor.position];
+          int const block_row = row_offset - cursor.top;
+          if (block_row == 0)
+            write_block_header_row(output, html, get_block(block_index),
+                                   sheet.block_classes.empty() ? std::string_view{} : sheet.block_classes[static_cast<std::size_t>(block_index)]);
+          else
+            write_block_data_row(output, row_html, get_block(block_index), block_row - 1);
+
+          write_empty_span(output, html, col.width - get_block(block_index).width);
+        }
+        else
+        {
+          write_empty_span(output, html, col.width);
+        }
+        used_width += col.width;
+      }
+
+      write_empty_span(output, html, table_width - used_width);
+      output += html.row_close;
+    }
+
+    if (sink && output.size() >= OutputFile::chunk_size)
+    {
+      sink->write(output);
+      output.clear();
+    }
+  }
+
+  output += html.minified ? "</table>" : "</table>\n";
+}
+
+void write_sheet_html(std::string& output, Sheet const& sheet, HtmlDialect const& html = pretty_html, OutputFile* sink = nullptr)
+{
+  output += html.minified ? "<div class=sheet>" : "<div class=\"sheet\">\n";
+  write_title_html(output, html, sheet, '1');
+  if (sheet.sections.empty())
+    write_table_html(output, sheet, html, sink);
+
+  // Each band of sections is a flex row; sheet.css puts section_gap columns between them.
+  for (std::size_t i = 0; i < sheet.sections.size(); ++i)
+  {
+    if (i == 0 || sheet.bands[i] != sheet.bands[i - 1])
+      output += html.minified ? "<div class=band>" : "<div class=\"band\">\n";
+    output += html.minified ? "<div class=section>" : "<div class=\"section\">\n";
+    write_title_html(output, html, sheet.sections[i], '2');
+    write_table_html(output, sheet.sections[i], html, sink);
+    output += html.minified ? "</div>" : "</div>\n";
+    if (i + 1 == sheet.sections.size() || sheet.bands[i] != sheet.bands[i + 1])
+      output += html.minified ? "</div>" : "</div>\n";
+  }
+  output += html.minified ? "</div>" : "</div>\n";
+}
+
+std::string read_file(std::filesystem::path const& path)
+{
+  std::FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file)
+    throw IoError("unable to open " + path.string() + ": " + std::strerror(errno));
+
+  std::string contents;
+  std::array<char, 65536> buf;
+  std::size_t n;
+  while ((n = std::fread(buf.data(), 1, buf.size(), file)) > 0)
+    contents.append(buf.data(), n);
+  bool const failed = std::ferror(file);
+  std::fclose(file);
+  if (failed)
+    throw IoError("failed to read " + path.string());
+
+  return contents;
+}
+
+// SAX handler that builds an ordered_json DOM in linear time.
+//
+// json::parse inserts every object member through ordered_map::emplace, which
+// first searches all existing members, so parsing an object with n members
+// takes O(n^2). This builder appends members directly and detects duplicate
+// keys (where, as with json::parse, the last value wins) with a hash index
+// that is only built for objects that have grown large.
+class OrderedDomBuilder
+{
+public:
+  explicit OrderedDomBuilder(json& root)
+      : m_root(root)
+  {
+  }
+
+  bool null() { return add(nullptr); }
+  bool boolean(bool value) { return add(value); }
+  bool number_integer(json::number_integer_t value) { return add(value); }
+  bool number_unsigned(json::number_unsigned_t value) { return add(value); }
+  bool number_float(json::number_float_t value, json::string_t const&) { return add(value); }
+  bool string(json::string_t& value) { return add(std::move(value)); }
+  bool binary(json::binary_t& value) { return add(json::binary(std::move(value))); }
+
+  bool start_object(std::size_t)
+  {
+    m_stack.push_back({add_container(json::object()), {}});
+    return true;
+  }
+
+  bool key(json::string_t& key)
+  {
+    Frame& frame = m_stack.back();
+    auto& members = static_cast<JsonMembers&>(frame.value->get_ref<json::object_t&>());
+
+    std::size_t existing = members.size();
+    if (!frame.index.empty())
+      existing = frame.index.find(members, key);
+    else
+    {
+      for (std::size_t i = 0; i < members.size(); ++i)
+        if (members[i].first == key)
+          existing = i;
+    }
+
+    if (existing == members.size())
+    {
+      members.emplace_back(std::move(key), nullptr);
+      if (!frame.index.empty() || members.size() > index_threshold)
+        frame.index.insert(members, existing);
+    }
+    m_member = &members[existing].second;
+    return true;
+  }
+
+  bool end_object()
+  {
+    m_stack.pop_back();
+    return true;
+  }
+
+  bool start_array(std::size_t)
+  {
+    m_stack.push_back({add_container(json::array()), {}});
+    return true;
+  }
+
+  bool end_array()
+  {
+    m_stack.pop_back();
+    return true;
+  }
+
+  bool parse_error(std::size_t, std::string const&, json::exception const& ex)
+  {
+    // Rethrow with the dynamic type that json::parse would have used.
+    switch ((ex.id / 100) % 100)
+    {
+      case 1: throw *static_cast<json::parse_error const*>(&ex);
+      case 2: throw *static_cast<json::invalid_iterator const*>(&ex);
+      case 3: throw *static_cast<json::type_error const*>(&ex);
+      case 4: throw *static_cast<json::out_of_range const*>(&ex);
+      default: throw *static_cast<json::other_error const*>(&ex);
+    }
+  }
+
+private:
+  static constexpr std::size_t index_threshold = 16;
+
+  struct Frame
+  {
+    json* value;
+    MemberIndex index;
+  };
+
+  template<typename T>
+  bool add(T&& value)
+  {
+    *slot() = json(std::forward<T>(value));
+    return true;
+  }
+
+  json* add_container(json&& value)
+  {
+    json* target = slot();
+    *target = std::move(value);
+    return target;
+  }
+
+  // Where the next value goes: the root, the end of the current array or the member named by the last key.
+  json* slot()
+  {
+    if (m_stack.empty())
+      return &m_root;
+    json* parent = m_stack.back().value;
+    if (parent->is_array())
+    {
+      json::array_t& array = parent->get_ref<json::array_t&>();
+      array.emplace_back();
+      return &array.back();
+    }
+    return m_member;
+  }
+
+  json& m_root;
+  std::vector<Frame> m_stack;
+  json* m_member = nullptr;
+};
+
+json parse_json(std::string const& input)
+{
+  json j;
+  OrderedDomBuilder builder(j);
+  json::sax_parse(input, &builder);
+  return j;
+}
+
+// The sheets of a parsed input: the array of them, or an array of the one sheet.
+json sheets_of(json j)
+{
+  json sheets = json::array();
+  if (j.is_array())
+    sheets = std::move(j);
+  else if (j.is_object())
+    sheets.push_back(std::move(j));
+  else
+    throw std::runtime_error("top-level JSON must be an object or array of objects");
+
+  for (std::size_t i = 0; i < sheets.size(); ++i)
+  {
+    if (!sheets.at(i).is_object())
+      throw std::runtime_error("top-level array element " + std::to_string(i) + " must be an object");
+  }
+
+  return sheets;
+}
+
+// Deep-merge `patch` over `target` like a JSON merge patch (RFC 7386): the
+// members of objects are merged one by one, null removes a member and any
+// other value replaces it. Members keep their order and new ones are appended.
+void merge_json(json& target, json const& patch)
+{
+  if (!patch.is_object() || !target.is_object())
+  {
+    target = patch;
+    return;
+  }
+  auto& members = static_cast<JsonMembers&>(target.get_ref<json::object_t&>());
+  MemberIndex index;
+  for (std::size_t i = 0; i < members.size(); ++i)
+    index.insert(members, i);
+  bool removed = false;
+  for (auto const& [key, value] : members_of(patch))
+  {
+    std::size_t const position = index.empty() ? members.size() : index.find(members, key);
+    if (position < members.size())
+    {
+      removed = removed || value.is_null();
+      if (value.is_null())
+        members[position].second = json(json::value_t::discarded);
+      else
+        merge_json(members[position].second, value);
+    }
+    else if (!value.is_null())
+    {
+      members.emplace_back(key, value);
+      index.insert(members, members.size() - 1);
+    }
+  }
+  if (removed)
+  {
+    // The keys are const, so the members that remain are moved to a new vector.
+    JsonMembers remaining;
+    remaining.reserve(members.size());
+    for (auto& [key, value] : members)
+    {
+      if (!value.is_discarded())
+        remaining.emplace_back(key, std::move(value));
+    }
+    members.clear();
+    for (auto& [key, value] : remaining)
+      members.emplace_back(key, std::move(value));
+  }
+}
+
+std::string sheet_label_of(std::size_t index, std::size_t count)
+{
+  return count == 1 ? "sheet" : "sheet[" + std::to_string(index) + "]";
+}
+
+// Whether two sheet definitions agree in everything but their title, id and base.
+bool same_geometry(json const& a, json const& b)
+{
+  auto geometry = [](std::string const& key) { return key != "title" && key != "id" && key != "extends"; };
+  std::size_t a_count = 0;
+  for (auto const& [key, value] : members_of(a))
+  {
+    if (!geometry(key))
+      continue;
+    ++a_count;
+    json const* const other = find_member(&b, key);
+    if (!other || *other != value)
+      return false;
+  }
+  return a_count == static_cast<std::size_t>(std::count_if(members_of(b).begin(), members_of(b).end(),
+                                                           [&](auto const& member) { return geometry(member.first); }));
+}
+
+// "extends": a sheet may name a base definition that its own members are
+// deep-merged over. The base is the sheet of the same input with that "id",
+// or else a file, relative to the input, that has a single sheet, or
+// "<file>#<id>" for one of several; bases may extend other bases. Every file
+// of bases is read, parsed and resolved once per run, and every base is laid
+// out once per set of layout options, for the derived sheets that only change
+// its title to copy.
+class SheetBases
+{
+public:
+  // Resolve the sheets of the input file `origin`: a derived sheet is replaced
+  // by the merged definition, whose "extends" then names the base by its key.
+  // Problems are added to `errors`; a sheet whose base they concern is left as it is.
+  json resolve(json sheets, std::filesystem::path const& origin, std::vector<Diagnostic>& errors)
+  {
+    auto schema_error = [&](std::string message) { errors.push_back({Metrics::ErrorKind::json_schema, std::move(message)}); };
+    auto error = [&](std::string message) { errors.push_back({Metrics::ErrorKind::validation, std::move(message)}); };
+
+    std::map<std::string, std::size_t, std::less<>> ids;
+    for (std::size_t i = 0; i < sheets.size(); ++i)
+    {
+      json const* const id = find_member(&sheets[i], "id");
+      if (!id)
+        continue;
+      if (!id->is_string())
+        schema_error(sheet_label_of(i, sheets.size()) + ".id must be a string");
+      else if (!ids.emplace(id->get<std::string>(), i).second)
+        error(sheet_label_of(i, sheets.size()) + ".id '" + id->get<std::string>() + "' is not unique");
+    }
+
+    enum class State
+    {
+      unresolved,
+      resolving,
+      resolved,
+      failed // The problem is reported once, where it was found.
+    };
+    std::vector<State> states(sheets.size());
+    std::set<std::string> reported_files;
+    // Whether sheet i could be resolved.
+    auto resolve_sheet = [&](auto& self, std::size_t i) -> bool {
+      if (states[i] == State::resolved || states[i] == State::failed)
+        return states[i] == State::resolved;
+      std::string const what = sheet_label_of(i, sheets.size()) + ".extends";
+      if (states[i] == State::resolving)
+      {
+        error(what + ": the sheet is its own base");
+        return false;
+      }
+      json const* const extends = find_member(&sheets[i], "extends");
+      if (!extends)
+      {
+        states[i] = State::resolved;
+        return true;
+      }
+      states[i] = State::failed;
+      if (!extends->is_string())
+      {
+        schema_error(what + " must be a string");
+        return false;
+      }
+
+      std::string const& reference = extends->get_ref<std::string const&>();
+      std::string key;
+      json const* base = nullptr;
+      if (auto const id = ids.find(reference); id != ids.end())
+      {
+        states[i] = State::resolving;
+        bool const resolved = self(self, id->second);
+        states[i] = State::failed;
+        if (!resolved)
+          return false;
+        key = origin.string() + "#" + reference;
+        base = &sheets[id->second];
+      }
+      else
+      {
+        std::size_t const hash = reference.find('#');
+        std::filesystem::path const path = origin.parent_path() / reference.substr(0, hash);
+        if (hash == 0 || !std::filesystem::is_regular_file(path))
+        {
+          error(what + ": '" + reference + "' is neither the id of a sheet of this input nor a file");
+          return false;
+        }
+        File const* const file = load(path);
+        if (!file)
+        {
+          error(what + ": the bases in " + path.string() + " extend it in turn");
+          return false;
+        }
+        if (!file->errors.empty())
+        {
+          if (reported_files.insert(file->key).second)
+            errors.insert(errors.end(), file->errors.begin(), file->errors.end());
+          return false;
+        }
+        key = file->key;
+        if (hash == std::string::npos)
+        {
+          if (file->sheets.size() != 1)
+          {
+            error(what + ": " + reference + " has " + std::to_string(file->sheets.size()) + " sheets; name one as <file>#<id>");
+            return false;
+          }
+          base = &file->sheets[0];
+        }
+        else
+        {
+          std::string const id = reference.substr(hash + 1);
+          key += "#" + id;
+          for (json const& sheet : file->sheets)
+          {
+            json const* const sheet_id = find_member(&sheet, "id");
+            if (sheet_id && *sheet_id == id)
+              base = &sheet;
+          }
+          if (!base)
+          {
+            error(what + ": " + path.string() + " has no sheet with the id '" + id + "'");
+            return false;
+          }
+        }
+      }
+      add_base(key, *base);
+
+      json merged = *base;
+      merged.erase("id");
+      merge_json(merged, sheets[i]);
+      merged["extends"] = key;
+      sheets[i] = std::move(merged);
+      states[i] = State::resolved;
+      return true;
+    };
+    for (std::size_t i = 0; i < sheets.size(); ++i)
+      resolve_sheet(resolve_sheet, i);
+    return sheets;
+  }
+
+  // The layout of the base of the derived sheet `j`, if `j` has the same
+  // geometry and the base is valid; made on first use.
+  std::shared_ptr<Sheet const> base_layout(json const& j, LayoutOptions const& layout_options)
+  {
+    json const* const extends = find_member(&j, "extends");
+    if (!extends || !extends->is_string())
+      return nullptr;
+    Base* base = nullptr;
+    {
+      std::lock_guard const lock(m_bases_mutex);
+      auto const found = m_bases.find(extends->get_ref<std::string const&>());
+      if (found == m_bases.end())
+        return nullptr;
+      base = found->second.get();
+    }
+    if (!same_geometry(j, base->definition))
+      return nullptr;
+
+    std::lock_guard const lock(base->mutex);
+    std::shared_ptr<Sheet const>& layout = base->layouts[{layout_options.explain, layout_options.header_fit, layout_options.orientation}];
+    if (!layout)
+      layout = std::make_shared<Sheet const>(layout_sheet(base->definition, extends->get<std::string>(), layout_options));
+    return layout->errors.empty() ? layout : nullptr;
+  }
+
+private:
+  struct Base
+  {
+    json definition;
+    std::mutex mutex;
+    std::map<std::tuple<bool, HeaderFit, Orientation>, std::shared_ptr<Sheet const>> layouts;
+  };
+
+  // A file of bases: its resolved sheets, or the problems with it, their messages naming the file.
+  struct File
+  {
+    std::string key;
+    json sheets;
+    std::vector<Diagnostic> errors;
+  };
+
+  // The file of bases at `path`, read, parsed and resolved on first use; null
+  // while it is being resolved, for a file whose bases extend it in turn.
+  File const* load(std::filesystem::path const& path)
+  {
+    std::string const key = std::filesystem::weakly_canonical(path).string();
+    // Held while the file is resolved, which may load further files on this thread.
+    std::lock_guard const lock(m_files_mutex);
+    if (auto const found = m_files.find(key); found != m_files.end())
+      return &found->second;
+    if (std::find(m_loading.begin(), m_loading.end(), key) != m_loading.end())
+      return nullptr;
+
+    File file;
+    file.key = key;
+    std::vector<Diagnostic> errors;
+    m_loading.push_back(key);
+    try
+    {
+      // Classified as generate() classifies the same problems with its input.
+      try
+      {
+        file.sheets = resolve(sheets_of(parse_json(read_file(path))), path, errors);
+      }
+      catch (json::parse_error const& e)
+      {
+        errors.push_back({Metrics::ErrorKind::json_syntax, e.what()});
+      }
+      catch (json::exception const& e)
+      {
+        errors.push_back({Metrics::ErrorKind::json_schema, e.what()});
+      }
+      catch (IoError const&)
+      {
+        throw;
+      }
+      catch (MemoryBudgetError const&)
+      {
+        throw;
+      }
+      catch (InternalError const&)
+      {
+        throw;
+      }
+      catch (std::runtime_error const& e) // From sheets_of().
+      {
+        errors.push_back({Metrics::ErrorKind::validation, e.what()});
+      }
+    }
+    catch (...)
+    {
+      m_loading.pop_back();
+      throw;
+    }
+    m_loading.pop_back();
+    for (Diagnostic& error : errors)
+      file.errors.push_back({error.kind, path.string() + ": " + error.message});
+    return &m_files.emplace(key, std::move(file)).first->second;
+  }
+
+  void add_base(std::string const& key, json const& definition)
+  {
+    std::lock_guard const lock(m_bases_mutex);
+    std::unique_ptr<Base>& base = m_bases[key];
+    if (!base)
+    {
+      base = std::make_unique<Base>();
+      base->definition = definition;
+    }
+  }
+
+  std::recursive_mutex m_files_mutex;
+  std::map<std::string, File> m_files;
+  std::vector<std::string> m_loading; // The files being resolved, to catch cycles.
+  std::mutex m_bases_mutex;
+  std::map<std::string, std::unique_ptr<Base>> m_bases;
+};
+
+SheetBases g_sheet_bases;
+
+// The sheets of the input `input`, read from the file `origin`, with their
+// bases resolved; the problems with those are added to `errors`.
+json parse_sheets(std::string const& input, std::filesystem::path const& origin, std::vector<Diagnostic>& errors)
+{
+  return g_sheet_bases.resolve(sheets_of(parse_json(input)), origin, errors);
+}
+
+// A derived sheet with the geometry of its base gets a copy of the layout of
+// the base, with its own label and title.
+std::optional<Sheet> reuse_base_layout(json const& j, std::string const& sheet_label, LayoutOptions const& layout_options)
+{
+  json const* const title = find_member(&j, "title");
+  json const* const left = find_member(title, "left");
+  json const* const right = find_member(title, "right");
+  if (!left || !left->is_string() || !right || !right->is_string())
+    return {};
+  std::shared_ptr<Sheet const> const base = g_sheet_bases.base_layout(j, layout_options);
+  if (!base)
+    return {};
+
+  Sheet sheet = *base;
+  sheet.label = sheet_label;
+  for (std::size_t i = 0; i < sheet.sections.size(); ++i)
+    sheet.sections[i].label = sheet_label + ".sections[" + std::to_string(i) + "]";
+  sheet.title_left = left->get<std::string>();
+  sheet.title_right = right->get<std::string>();
+  if (sheet.sections.empty())
+  {
+    std::erase(sheet.warnings, title_too_wide);
+    if (!title_fits(sheet))
+      sheet.warnings.emplace_back(title_too_wide);
+  }
+  if (g_log.enabled())
+    g_log.log("%s: layout of %s reused\n", sheet_label.c_str(), find_member(&j, "extends")->get_ref<std::string const&>().c_str());
+  return sheet;
+}
+
+std::vector<Sheet> layout_sheets(json const& sheets, std::vector<double>* layout_seconds = nullptr, LayoutOptions const& layout_options = {})
+{
+  std::vector<Sheet> out;
+  out.reserve(sheets.size());
+  for (std::size_t i = 0; i < sheets.size(); ++i)
+  {
+    std::string const label = sheet_label_of(i, sheets.size());
+    auto const start = std::chrono::steady_clock::now();
+    std::optional<Sheet> reused = reuse_base_layout(sheets.at(i), label, layout_options);
+    out.push_back(reused ? std::move(*reused) : layout_sheet(sheets.at(i), label, layout_options));
+    if (layout_seconds)
+      layout_seconds->push_back(seconds_since(start));
+  }
+  return out;
+}
+
+// The problems found while laying out `sheets`, in input order.
+std::vector<Diagnostic> sheet_errors(std::vector<Sheet> const& sheets)
+{
+  std::vector<Diagnostic> errors;
+  for (Sheet const& sheet : sheets)
+    errors.insert(errors.end(), sheet.errors.begin(), sheet.errors.end());
+  return errors;
+}
+
+struct SheetRenderRecord
+{
+  double seconds = 0.0;
+  std::size_t bytes = 0;
+};
+
+// The start of an HTML document, up to the first sheet; `style` replaces the link to sheet.css when not empty.
+// With `page`, an @page rule selects the paper orientation that the layout was made for.
+std::string document_head(HtmlDialect const& html, std::string_view style = {}, std::optional<Orientation> page = {})
+{
+  std::string head;
+  if (html.minified)
+  {
+    head = "<!DOCTYPE html><meta charset=utf-8><title>passphrase</title>";
+    if (page)
+    {
+      head += "<style>@page{size:A4 ";
+      head += orientation_name(*page);
+      head += "}</style>";
+    }
+    if (style.empty())
+      head += "<link rel=stylesheet href=sheet.css>";
+    else
+    {
+      head += "<style>";
+      head += style;
+      head += "</style>";
+    }
+    return head;
+  }
+
+  bool const landscape = page == Orientation::landscape;
+  head = "<!DOCTYPE html>\n<!-- Print from Firefox (control-P) ";
+  head += landscape ? "Landscape" : "Portrait";
+  head += R"(, Paper size A4, Scale 90%, Margins Default, Print headers and footers OFF -->
+<html>
+<head>
+  <meta http-equiv="content-type" content="text/html; charset=utf-8"/>
+  <title>passphrase</title>
+)";
+  if (page)
+  {
+    head += "  <style>@page { size: A4 ";
+    head += orientation_name(*page);
+    head += "; }</style>\n";
+  }
+  if (style.empty())
+    head += "  <link rel=\"stylesheet\" href=\"sheet.css\">\n";
+  else
+  {
+    head += "  <style>";
+    head += style;
+    head += "</style>\n";
+  }
+  head += "</head>\n<body>\n";
+  return head;
+}
+
+// Strip comments and all whitespace that does not separate two words; quoted strings are copied as is.
+std::string minify_css(std::string_view css)
+{
+  std::string out;
+  out.reserve(css.size());
+  auto is_punctuation = [](char ch) { return std::strchr("{}:;,>", ch) != nullptr; };
+  bool pending_space = false;
+  for (std::size_t i = 0; i < css.size(); ++i)
+  {
+    char const ch = css[i];
+    if (ch == '/' && i + 1 < css.size() && css[i + 1] == '*')
+    {
+      std::size_t const end = css.find("*/", i + 2);
+      i = end == std::string_view::npos ? css.size() : end + 1;
+      pending_space = true;
+      continue;
+    }
+    if (std::isspace(static_cast<unsigned char>(ch)))
+    {
+      pending_space = true;
+      continue;
+    }
+    if (pending_space && !out.empty() && !is_punctuation(out.back()) && !is_punctuation(ch))
+      out += ' ';
+    pending_space = false;
+    if (ch == '}' && !out.empty() && out.back() == ';')
+      out.back() = '}';
+    else if (ch == '"' || ch == '\'')
+    {
+      std::size_t const end = css.find(ch, i + 1);
+      std::size_t const length = (end == std::string_view::npos ? css.size() : end + 1) - i;
+      out += css.substr(i, length);
+      i += length - 1;
+    }
+    else
+      out += ch;
+  }
+  return out;
+}
+
+// The document heads used for all outputs of a batch. With --inline-css the
+// stylesheet is read and minified once, on first use, and each head is
+// prepared once per dialect.
+class DocumentHead
+{
+public:
+  explicit DocumentHead(std::string stylesheet_path = {})
+      : m_stylesheet_path(std::move(stylesheet_path))
+  {
+  }
+
+  std::string_view get(HtmlDialect const& html, std::optional<Orientation> page = {})
+  {
+    std::lock_guard<std::mutex> const lock(m_mutex);
+    std::string& head = m_heads[(html.minified ? 3 : 0) + (page ? 1 + static_cast<int>(*page) : 0)];
+    bool const hit = !head.empty();
+    if (!hit)
+    {
+      if (!m_style && !m_stylesheet_path.empty())
+        m_style = minify_css(read_file(m_stylesheet_path));
+      head = document_head(html, m_style ? std::string_view(*m_style) : std::string_view{}, page);
+    }
+    g_metrics.add_cache_lookup("document_head", hit);
+    return head;
+  }
+
+private:
+  std::string m_stylesheet_path; // Empty if the documents link to sheet.css.
+  std::mutex m_mutex;
+  std::optional<std::string> m_style;
+  std::array<std::string, 6> m_heads; // By HtmlDialect::minified, then no @page, portrait or landscape.
+};
+
+// Render the document into `output`. With a sink, output is handed to it in chunks
+// and whatever is left in `output` at the end is for the caller to write.
+// With an imposition, each sheet is rendered once and its bytes are repeated
+// for the copies, each in a slot of a CSS grid page when they share pages.
+void write_document_html(std::string& output, std::span<Sheet const> sheets, std::vector<SheetRenderRecord>* records = nullptr,
+                         HtmlDialect const& html = pretty_html, std::string_view head = {}, OutputFile* sink = nullptr,
+                         Imposition const& imposition = {})
+{
+  if (head.empty())
+    output += document_head(html);
+  else
+    output += head;
+
+  auto rendered = [&]() { return output.size() + (sink ? sink->bytes_in() : 0); };
+  std::string copy;
+  int slot = 0; // Of the N-up page that is open.
+  for (Sheet const& sheet : sheets)
+  {
+    auto const start = std::chrono::steady_clock::now();
+    std::size_t const size_before = rendered();
+    if (!imposition.enabled())
+      write_sheet_html(output, sheet, html, sink);
+    else
+    {
+      copy.clear();
+      write_sheet_html(copy, sheet, html);
+      int const zoom = imposition_zoom_percent(sheet, imposition);
+      for (int i = 0; i < imposition.copies; ++i)
+      {
+        if (imposition.nup > 1)
+        {
+          if (slot == 0)
+          {
+            auto const [columns, rows] = imposition.grid();
+            auto const [page_width, page_height] = page_size_px(imposition.orientation);
+            output += html.minified ? "<div class=nup style=\"" : "<div class=\"nup\" style=\"";
+            output += "width: ";
+            append_int(output, page_width);
+            output += "px; height: ";
+            append_int(output, page_height);
+            output += "px; grid-template-columns: repeat(";
+            append_int(output, columns);
+            output += ", 1fr); grid-template-rows: repeat(";
+            append_int(output, rows);
+            output += html.minified ? ", 1fr)\">" : ", 1fr)\">\n";
+          }
+          output += html.minified ? "<div class=copy><div style=\"zoom: " : "<div class=\"copy\"><div style=\"zoom: ";
+          append_int(output, zoom);
+          output += html.minified ? "%\">" : "%\">\n";
+        }
+        output += copy;
+        if (imposition.nup > 1)
+        {
+          output += html.minified ? "</div></div>" : "</div></div>\n";
+          if (++slot == imposition.nup)
+          {
+            output += html.minified ? "</div>" : "</div>\n";
+            slot = 0;
+          }
+        }
+        if (sink && output.size() >= OutputFile::chunk_size)
+        {
+          sink->write(output);
+          output.clear();
+        }
+      }
+    }
+    if (records)
+      records->push_back({seconds_since(start), rendered() - size_before});
+  }
+  if (slot > 0)
+    output += html.minified ? "</div>" : "</div>\n";
+
+  if (!html.minified)
+    output += "</body>\n</html>\n";
+}
+
+// The TikZ backend (--format=tex): one tikzpicture per sheet, drawn from the
+// same placements as the HTML table, with the coordinate system in table cells
+// (x to the right, y downwards). Every cell that the HTML table has a border
+// for gets a rectangle; grids are emitted as \foreach loops so that the output
+// stays small.
+
+void append_tex_escaped(std::string& out, char ch)
+{
+  switch (ch)
+  {
+    case '\\': out += "\\textbackslash{}"; break;
+    case '~': out += "\\textasciitilde{}"; break;
+    case '^': out += "\\textasciicircum{}"; break;
+    case '#': case '$': case '%': case '&': case '_': case '{': case '}':
+      out += '\\';
+      out += ch;
+      break;
+    default: out += ch; break;
+  }
+}
+
+void append_tex_escaped(std::string& out, std::string_view s)
+{
+  for (char const ch : s)
+    append_tex_escaped(out, ch);
+}
+
+// Append a \foreach list of the characters of `s`, each braced so that commas and dots stay literal.
+void append_tex_char_list(std::string& out, std::string_view s)
+{
+  out += '{';
+  for (std::size_t i = 0; i < s.size(); ++i)
+  {
+    if (i > 0)
+      out += ',';
+    out += '{';
+    append_tex_escaped(out, s[i]);
+    out += '}';
+  }
+  out += '}';
+}
+
+// Empty bordered cells: `rows` rows of one cell of `width` columns, starting at (left, top).
+void write_tex_filler(std::string& out, int left, int top, int width, int rows)
+{
+  if (width <= 0 || rows <= 0)
+    return;
+
+  if (rows == 1)
+    out += "  \\draw (";
+  else
+  {
+    out += "  \\foreach \\r in {0,...,";
+    append_int(out, rows - 1);
+    out += "} \\draw (";
+  }
+  append_int(out, left);
+  out += ',';
+  append_int(out, top);
+  out += rows == 1 ? ")" : "+\\r)";
+  out += " rectangle +(";
+  append_int(out, width);
+  out += ",1);\n";
+}
+
+// One row of `chars.size()` single character cells at (left, top); `row` is appended
+// to the y coordinate of the nodes, so that the caller can wrap it in a loop over \r.
+void write_tex_char_row(std::string& out, int left, int top, std::string_view chars, std::string_view style, std::string_view row = {})
+{
+  out += "  \\draw (";
+  append_int(out, left);
+  out += ',';
+  append_int(out, top);
+  out += row;
+  out += ") grid +(";
+  append_int(out, static_cast<int>(chars.size()));
+  out += ",1); \\foreach \\ch [count=\\c from ";
+  append_int(out, left);
+  out += "] in ";
+  append_tex_char_list(out, chars);
+  out += " \\node[";
+  out += style;
+  out += "] at (\\c+.5,";
+  append_int(out, top);
+  out += row;
+  out += "+.5) {\\ch};\n";
+}
+
+void write_tex_block(std::string& out, Block const& block, int left, int top)
+{
+  out += "  % ";
+  append_tex_escaped(out, block.key);
+  out += '\n';
+  write_tex_filler(out, left, top, block.margin_left, block.height);
+  int const x = left + block.margin_left;
+  int const data_rows = block.height - 1;
+
+  out += "  \\draw (";
+  append_int(out, x);
+  out += ',';
+  append_int(out, top);
+  out += ") rectangle +(";
+  append_int(out, block.content_width + block.header_extra);
+  out += ",1) node[midway,header] {";
+  append_tex_escaped(out, block.header);
+  out += "};\n";
+
+  if (block.key == "keyid" || block.key == "keyid3")
+  {
+    // The "0 x" prefix spans two columns, and both data rows when compacted.
+    out += "  \\draw (";
+    append_int(out, x);
+    out += ',';
+    append_int(out, top + 1);
+    out += ") rectangle +(2,";
+    append_int(out, data_rows);
+    out += ") node[midway,data] {0\\,x};\n";
+    std::string_view const hex = block.keyid_hex16;
+    if (block.keyid_compact)
+    {
+      write_tex_char_row(out, x + 2, top + 1, hex.substr(0, 8), "data");
+      write_tex_char_row(out, x + 2, top + 2, hex.substr(8), "data");
+    }
+    else
+      write_tex_char_row(out, x + 2, top + 1, hex, "data");
+  }
+  else if (block.data == "grid10")
+  {
+    out += "  \\draw (";
+    append_int(out, x);
+    out += ',';
+    append_int(out, top + 1);
+    out += ") grid +(10,";
+    append_int(out, data_rows);
+    out += ");\n  \\foreach \\r in {";
+    append_int(out, top + 1);
+    out += ",...,";
+    append_int(out, top + data_rows);
+    out += "} \\foreach \\c in {0,...,9} \\node[grid] at (";
+    append_int(out, x);
+    out += "+\\c+.5,\\r+.5) {\\c};\n";
+  }
+  else if (block.data == "grid36")
+  {
+    // Groups (\\g) of four full rows, each followed by a row that only has the "-" cell.
+    std::string_view const row = "-ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    int const groups = (data_rows + 1) / 5;
+    int const separators = data_rows / 5;
+    int const trailing_rows = std::max(0, data_rows - groups * 5);
+    if (groups > 0)
+    {
+      out += "  \\foreach \\g in {0,...,";
+      append_int(out, groups - 1);
+      out += "} \\foreach \\r in {0,...,3} {\n  ";
+      write_tex_char_row(out, x, top + 1, row, "grid", "+5*\\g+\\r");
+      out += "  }\n";
+    }
+    if (separators > 0)
+    {
+      std::string const at = std::to_string(x) + ',' + std::to_string(top + 5) + "+5*\\g";
+      out += "  \\foreach \\g in {0,...,";
+      append_int(out, separators - 1);
+      out += "} \\draw (" + at + ") rectangle +(37,1) (" + at + ") +(1,0) -- +(1,1) (" + at + ") +(.5,.5) node[grid] {-};\n";
+    }
+    if (trailing_rows > 0)
+    {
+      out += "  \\foreach \\r in {0,...,";
+      append_int(out, trailing_rows - 1);
+      out += "} {\n  ";
+      write_tex_char_row(out, x, top + 1 + groups * 5, row, "grid", "+\\r");
+      out += "  }\n";
+    }
+  }
+  else
+    write_tex_char_row(out, x, top + 1, block.data, "data");
+
+  write_tex_filler(out, x + block.content_width + block.header_extra, top, block.margin_right - block.header_extra, 1);
+  write_tex_filler(out, x + block.content_width, top + 1, block.margin_right, block.height - 1);
+}
+
+void write_table_tex(std::string& output, Sheet const& sheet)
+{
+  output += "\\begin{tikzpicture}[sheet]\n";
+
+  std::vector<Placement> const placements = compute_placements(sheet);
+  std::size_t next = 0;
+  int group_top = 0;
+  for (RowGroup const& group : sheet.groups)
+  {
+    int col_left = 0;
+    for (auto const& col : group.columns())
+    {
+      int col_top = group_top;
+      for (std::size_t i = 0; i < col.blocks.size(); ++i, ++next)
+      {
+        Placement const& p = placements[next];
+        Block const& block = sheet.blocks[static_cast<std::size_t>(p.block)];
+        write_tex_block(output, block, p.left, p.top);
+        write_tex_filler(output, p.left + block.width, p.top, col.width - block.width, block.height);
+        col_top = p.top + block.height;
+      }
+      write_tex_filler(output, col_left, col_top, col.width, group_top + group.height() - col_top);
+      col_left += col.width;
+    }
+    write_tex_filler(output, col_left, group_top, sheet.table_width - col_left, group.height());
+    group_top += group.height();
+  }
+
+  output += "\\end{tikzpicture}\n";
+}
+
+// Opens the minipage of a sheet or section, as wide as its table, with its
+// title; sections in a band are aligned at the top.
+void write_tex_title(std::string& output, Sheet const& sheet, bool section)
+{
+  output += section ? "\\begin{minipage}[t]{" : "\\begin{minipage}{";
+  append_int(output, sheet.table_width);
+  output += section ? "\\cellwidth}\n{\\large\\bfseries\\makebox[\\linewidth]{" : "\\cellwidth}\n{\\Large\\bfseries\\makebox[\\linewidth]{";
+  append_tex_escaped(output, sheet.title_left);
+  output += "\\hfill ";
+  append_tex_escaped(output, sheet.title_right);
+  output += "}}\\par\\medskip\n";
+}
+
+void write_sheet_tex(std::string& output, Sheet const& sheet)
+{
+  write_tex_title(output, sheet, false);
+  if (sheet.sections.empty())
+    write_table_tex(output, sheet);
+
+  for (std::size_t i = 0; i < sheet.sections.size(); ++i)
+  {
+    if (i > 0 && sheet.bands[i] == sheet.bands[i - 1])
+    {
+      output += "\\hspace{";
+      append_int(output, section_gap);
+      output += "\\cellwidth}%\n";
+    }
+    write_tex_title(output, sheet.sections[i], true);
+    write_table_tex(output, sheet.sections[i]);
+    output += "\\end{minipage}%\n";
+    if (i + 1 == sheet.sections.size() || sheet.bands[i] != sheet.bands[i + 1])
+      output += "\\par\\medskip\n";
+  }
+  output += "\\end{minipage}";
+}
+
+// Appends a TikZ coordinate that is the fractions x and y of the way across
+// and down an N-up page, shifted by the TikZ options in `shift`.
+void append_tex_page_point(std::string& output, int x_numerator, int x_denominator, int y_numerator, int y_denominator,
+                           std::string_view shift = {})
+{
+  output += '(';
+  output += shift;
+  append_int(output, x_numerator);
+  output += '/';
+  append_int(output, x_denominator);
+  output += ',';
+  append_int(output, y_numerator);
+  output += '/';
+  append_int(output, y_denominator);
+  output += ')';
+}
+
+// One N-up page: the copies in `nodes`, and cut marks at the slot boundaries,
+// outside the text area along its edges and as crosses where slots meet.
+void write_tex_nup_page(std::string& output, std::string_view nodes, Imposition const& imposition)
+{
+  auto const [columns, rows] = imposition.grid();
+  output += "\\noindent\\begin{tikzpicture}[x=\\textwidth, y=-\\textheight]\n"
+            "\\path[use as bounding box] (0,0) rectangle (1,1);\n";
+  output += nodes;
+  for (int column = 0; column <= columns; ++column)
+  {
+    output += "\\draw[cutmark] ";
+    append_tex_page_point(output, column, columns, 0, 1, "[yshift=2mm]");
+    output += " -- ++(0,5mm) ";
+    append_tex_page_point(output, column, columns, 1, 1, "[yshift=-2mm]");
+    output += " -- ++(0,-5mm);\n";
+  }
+  for (int row = 0; row <= rows; ++row)
+  {
+    output += "\\draw[cutmark] ";
+    append_tex_page_point(output, 0, 1, row, rows, "[xshift=-2mm]");
+    output += " -- ++(-5mm,0) ";
+    append_tex_page_point(output, 1, 1, row, rows, "[xshift=2mm]");
+    output += " -- ++(5mm,0);\n";
+  }
+  for (int column = 1; column < columns; ++column)
+  {
+    for (int row = 1; row < rows; ++row)
+    {
+      output += "\\draw[cutmark] ";
+      append_tex_page_point(output, column, columns, row, rows);
+      output += " +(-2mm,0) -- +(2mm,0) +(0,-2mm) -- +(0,2mm);\n";
+    }
+  }
+  output += "\\end{tikzpicture}\\newpage\n\n";
+}
+
+// With an imposition, each sheet is typeset once by \savesheet and placed for
+// every copy by \usesheet; pdfTeX and LuaTeX make it a form XObject that the
+// copies refer to, so the PDF does not grow with the number of copies.
+void write_document_tex(std::string& output, std::span<Sheet const> sheets, std::vector<SheetRenderRecord>* records = nullptr,
+                        OutputFile* sink = nullptr, Orientation orientation = Orientation::portrait, Imposition const& imposition = {})
+{
+  output += "% Compile with pdflatex; the layout matches the HTML version printed on A4 ";
+  output += orientation_name(orientation);
+  output += orientation == Orientation::portrait ? ".\n\\documentclass[a4paper]{article}\n" : ".\n\\documentclass[a4paper,landscape]{article}\n";
+  output += R"(\usepackage[margin=15mm]{geometry}
+\usepackage[T1]{fontenc}
+\usepackage{tikz}
+\renewcommand{\familydefault}{\sfdefault}
+\pagestyle{empty}
+\setlength{\parindent}{0pt}
+\newlength{\cellwidth}
+\setlength{\cellwidth}{4.8mm}
+\newlength{\cellheight}
+\setlength{\cellheight}{4.6mm}
+\tikzset{
+  sheet/.style={x=\cellwidth, y=-\cellheight, line width=0.4pt, every node/.style={inner sep=0pt}},
+  header/.style={font=\normalsize},
+  data/.style={font=\normalsize},
+  grid/.style={font=\scriptsize}
+}
+)";
+  if (imposition.enabled())
+  {
+    output += R"(\usepackage{graphicx}
+% \savesheet{<n>}{<sheet>} typesets a sheet once, \usesheet{<n>} places a copy of it.
+\newsavebox{\sheetbox}
+\newcommand{\savesheet}[2]{%
+  \sbox{\sheetbox}{#2}%
+  \ifdefined\pdfxform
+    \immediate\pdfxform\sheetbox
+    \expandafter\xdef\csname sheet#1\endcsname{\noexpand\pdfrefxform\the\pdflastxform\relax}%
+  \else\ifdefined\saveboxresource
+    \immediate\saveboxresource\sheetbox
+    \expandafter\xdef\csname sheet#1\endcsname{\noexpand\useboxresource\the\lastsavedboxresourceindex\relax}%
+  \else
+    \expandafter\newsavebox\csname sheetcopy#1\endcsname
+    \global\expandafter\setbox\csname sheetcopy#1\endcsname\box\sheetbox
+    \expandafter\xdef\csname sheet#1\endcsname{\noexpand\usebox{\expandafter\noexpand\csname sheetcopy#1\endcsname}}%
+  \fi\fi}
+\newcommand{\usesheet}[1]{\csname sheet#1\endcsname}
+% \fitsheet{<copy>} scales a copy down, never up, to fit a slot of an N-up page.
+\newlength{\slotwidth}
+\newlength{\slotheight}
+\newsavebox{\slotbox}
+\newcommand{\fitsheet}[1]{%
+  \sbox{\slotbox}{#1}%
+  \ifdim\wd\slotbox>\slotwidth \sbox{\slotbox}{\resizebox{\slotwidth}{!}{\usebox{\slotbox}}}\fi
+  \ifdim\dimexpr\ht\slotbox+\dp\slotbox\relax>\slotheight \sbox{\slotbox}{\resizebox*{!}{\slotheight}{\usebox{\slotbox}}}\fi
+  \usebox{\slotbox}}
+\tikzset{cutmark/.style={line width=0.2pt}}
+)";
+  }
+  output += "\\begin{document}\n";
+  if (imposition.enabled())
+  {
+    auto const [columns, rows] = imposition.grid();
+    output += "\\setlength{\\slotwidth}{\\dimexpr\\textwidth/";
+    append_int(output, columns);
+    output += "-6mm\\relax}\n\\setlength{\\slotheight}{\\dimexpr\\textheight/";
+    append_int(output, rows);
+    output += "-6mm\\relax}\n\n";
+  }
+
+  auto rendered = [&]() { return output.size() + (sink ? sink->bytes_in() : 0); };
+  std::string nodes; // The copies on the N-up page that is being filled.
+  int slot = 0;
+  for (std::size_t n = 0; n < sheets.size(); ++n)
+  {
+    Sheet const& sheet = sheets[n];
+    auto const start = std::chrono::steady_clock::now();
+    std::size_t const size_before = rendered();
+    if (!imposition.enabled())
+    {
+      write_sheet_tex(output, sheet);
+      output += "\\par\\bigskip\n\n";
+    }
+    else
+    {
+      // Saved ahead of the page that it first appears on, outside of its tikzpicture.
+      output += "\\savesheet{";
+      append_int(output, static_cast<long long>(n));
+      output += "}{%\n";
+      write_sheet_tex(output, sheet);
+      output += "}\n";
+      for (int i = 0; i < imposition.copies; ++i)
+      {
+        if (imposition.nup == 1)
+        {
+          output += "\\usesheet{";
+          append_int(output, static_cast<long long>(n));
+          output += "}\\par\\bigskip\n\n";
+          continue;
+        }
+        auto const [columns, rows] = imposition.grid();
+        nodes += "\\node at ";
+        append_tex_page_point(nodes, 2 * (slot % columns) + 1, 2 * columns, 2 * (slot / columns) + 1, 2 * rows);
+        nodes += " {\\fitsheet{\\usesheet{";
+        append_int(nodes, static_cast<long long>(n));
+        nodes += "}}};\n";
+        if (++slot == imposition.nup)
+        {
+          write_tex_nup_page(output, nodes, imposition);
+          nodes.clear();
+          slot = 0;
+        }
+      }
+    }
+    if (records)
+      records->push_back({seconds_since(start), rendered() - size_before});
+    if (sink && output.size() >= OutputFile::chunk_size)
+    {
+      sink->write(output);
+      output.clear();
+    }
+  }
+
+  if (slot > 0)
+    write_tex_nup_page(output, nodes, imposition);
+  output += "\\end{document}\n";
+}
+
+void write_output_file(std::filesystem::path const& output_file_path, std::string_view contents)
+{
+  std::FILE* file = std::fopen(output_file_path.c_str(), "wb");
+  if (!file)
+    throw IoError("unable to open output file " + output_file_path.string());
+  bool const ok = std::fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+  if (std::fclose(file) != 0 || !ok)
+    throw IoError("failed to write output file " + output_file_path.string());
+}
+
+void write_stdout(std::string_view text)
+{
+  std::fwrite(text.data(), 1, text.size(), stdout);
+}
+
+void write_stderr(std::string_view text)
+{
+  std::fwrite(text.data(), 1, text.size(), stderr);
+}
+
+// Append printf-formatted text to `out`.
+[[gnu::format(printf, 2, 3)]] void append_printf(std::string& out, char const* format, ...)
+{
+  std::va_list args;
+  va_start(args, format);
+  std::va_list args_copy;
+  va_copy(args_copy, args);
+  int const length = std::vsnprintf(nullptr, 0, format, args);
+  va_end(args);
+  if (length > 0)
+  {
+    std::size_t const size = out.size();
+    out.resize(size + static_cast<std::size_t>(length) + 1);
+    std::vsnprintf(out.data() + size, static_cast<std::size_t>(length) + 1, format, args_copy);
+    out.resize(size + static_cast<std::size_t>(length));
+  }
+  va_end(args_copy);
+}
+
+// Write the metrics text to `destination`: either a file, replaced atomically so that a
+// textfile collector never sees a partial file, or "unix:<path>" to push it to a local
+// Unix stream socket.
+void write_metrics(std::string const& destination, std::string const& text)
+{
+  if (destination.rfind("unix:", 0) == 0)
+  {
+    std::string const socket_path = destination.substr(5);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+      throw IoError("metrics socket path too long: " + socket_path);
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    int const fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      throw IoError(std::string("socket: ") + std::strerror(errno));
+    if (connect(fd, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) == -1)
+    {
+      int const error = errno;
+      close(fd);
+      throw IoError("unable to connect to metrics socket " + socket_path + ": " + std::strerror(error));
+    }
+    std::size_t written = 0;
+    while (written < text.size())
+    {
+      ssize_t const n = ::write(fd, text.data() + written, text.size() - written);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+      {
+        int const error = errno;
+        close(fd);
+        throw IoError("failed to write to metrics socket " + socket_path + ": " + std::strerror(error));
+      }
+      written += static_cast<std::size_t>(n);
+    }
+    close(fd);
+    return;
+  }
+
+  std::filesystem::path const path(destination);
+  std::filesystem::path tmp_path = path;
+  tmp_path += ".tmp";
+  write_output_file(tmp_path, text);
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec)
+    throw IoError("unable to rename " + tmp_path.string() + " to " + path.string() + ": " + ec.message());
+}
+
+// Hardware performance counters for the benchmark phases.
+//
+// The counters are opened as a single perf_event group (instructions, cycles,
+// cache misses and branch misses, user space only) so that they are enabled
+// and read atomically. When perf_event_open is not permitted or not supported
+// (containers, VMs, kernel.perf_event_paranoid) available() returns false and
+// only wall-clock time is reported.
+class PerfCounters
+{
+public:
+  struct Sample
+  {
+    std::uint64_t wall_ns = 0;
+    std::uint64_t instructions = 0;
+    std::uint64_t cycles = 0;
+    std::uint64_t cache_misses = 0;
+    std::uint64_t branch_misses = 0;
+
+    Sample& operator+=(Sample const& rhs)
+    {
+      wall_ns += rhs.wall_ns;
+      instructions += rhs.instructions;
+      cycles += rhs.cycles;
+      cache_misses += rhs.cache_misses;
+      branch_misses += rhs.branch_misses;
+      return *this;
+    }
+  };
+
+  PerfCounters()
+  {
+#ifdef __linux__
+    static constexpr std::array<std::pair<std::uint64_t, char const*>, number_of_counters> events = {{
+        {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+        {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+        {PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+        {PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    }};
+
+    for (std::size_t i = 0; i < events.size(); ++i)
+    {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = events[i].first;
+      attr.disabled = (i == 0) ? 1 : 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      int const group_fd = (i == 0) ? -1 : m_fds[0];
+      long const fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+      if (fd == -1)
+      {
+        m_reason = std::string("perf_event_open(") + events[i].second + "): " + std::strerror(errno);
+        close_all();
+        return;
+      }
+      m_fds[i] = static_cast<int>(fd);
+    }
+#else
+    m_reason = "perf_event_open is only supported on Linux";
+#endif
+  }
+
+  ~PerfCounters() { close_all(); }
+
+  PerfCounters(PerfCounters const&) = delete;
+  PerfCounters& operator=(PerfCounters const&) = delete;
+
+  [[nodiscard]] bool available() const { return m_fds[0] != -1; }
+  [[nodiscard]] std::string const& unavailable_reason() const { return m_reason; }
+
+  void start()
+  {
+#ifdef __linux__
+    if (available())
+    {
+      ioctl(m_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+    m_start = std::chrono::steady_clock::now();
+  }
+
+  Sample stop()
+  {
+    auto const end = std::chrono::steady_clock::now();
+    Sample sample;
+    sample.wall_ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count());
+#ifdef __linux__
+    if (available())
+    {
+      ioctl(m_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+      // Layout of PERF_FORMAT_GROUP with both TOTAL_TIME flags: nr, time_enabled, time_running, value[nr].
+      std::array<std::uint64_t, 3 + number_of_counters> buf{};
+      if (read(m_fds[0], buf.data(), sizeof(buf)) == static_cast<ssize_t>(sizeof(buf)) && buf[0] == number_of_counters)
+      {
+        // Scale up if the kernel had to multiplex the counters.
+        double const scale = (buf[2] != 0 && buf[2] < buf[1]) ? static_cast<double>(buf[1]) / static_cast<double>(buf[2]) : 1.0;
+        auto value = [&](std::size_t i) { return static_cast<std::uint64_t>(static_cast<double>(buf[3 + i]) * scale); };
+        sample.instructions = value(0);
+        sample.cycles = value(1);
+        sample.cache_misses = value(2);
+        sample.branch_misses = value(3);
+      }
+    }
+#endif
+    return sample;
+  }
+
+private:
+  static constexpr std::size_t number_of_counters = 4;
+
+  void close_all()
+  {
+    for (int& fd : m_fds)
+    {
+      if (fd != -1)
+        close(fd);
+      fd = -1;
+    }
+  }
+
+  std::array<int, number_of_counters> m_fds{-1, -1, -1, -1};
+  std::string m_reason;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+// `generator diff <old> <new>`: compare the placement IR of two versions of a sheet file.
+//
+// Sheets are matched by position and blocks by key. Reports blocks that were
+// added, removed, moved, changed shape (width or keyid compaction) or changed
+// height, and the estimated page count of both versions. With an html path,
+// the new version is also rendered with the headers of changed blocks
+// highlighted. Returns the number of differences found.
+int diff_sheets(std::vector<Sheet> const& old_sheets, std::vector<Sheet>& new_sheets, std::string& out, bool count_pages = true)
+{
+  int differences = 0;
+  char line[256];
+  auto report = [&](std::string const& text) {
+    out += text;
+    ++differences;
+  };
+
+  for (std::size_t s = 0; s < std::max(old_sheets.size(), new_sheets.size()); ++s)
+  {
+    if (s >= old_sheets.size())
+    {
+      report("+ " + new_sheets[s].label + " added\n");
+      continue;
+    }
+    if (s >= new_sheets.size())
+    {
+      report("- " + old_sheets[s].label + " removed\n");
+      continue;
+    }
+
+    Sheet const& before = old_sheets[s];
+    Sheet& after = new_sheets[s];
+    out += after.label + ":\n";
+    if (before.table_width != after.table_width)
+      report("  table width " + std::to_string(before.table_width) + " -> " + std::to_string(after.table_width) + "\n");
+    if (!before.sections.empty() || !after.sections.empty())
+    {
+      if (before.bands != after.bands)
+        report("  sections rearranged\n");
+      differences += diff_sheets(before.sections, after.sections, out, false);
+      continue;
+    }
+
+    std::unordered_map<std::string_view, Placement> old_placements;
+    for (Placement const& p : compute_placements(before))
+      old_placements.emplace(before.blocks[static_cast<std::size_t>(p.block)].key, p);
+
+    after.block_classes.assign(after.blocks.size(), std::string_view{});
+    for (Placement const& p : compute_placements(after))
+    {
+      Block const& b = after.blocks[static_cast<std::size_t>(p.block)];
+      auto const it = old_placements.find(b.key);
+      if (it == old_placements.end())
+      {
+        std::snprintf(line, sizeof(line), "  added   %s at row %d, column %d\n", b.key.c_str(), p.top, p.left);
+        report(line);
+        after.block_classes[static_cast<std::size_t>(p.block)] = "diff-added";
+        continue;
+      }
+      Placement const& q = it->second;
+      Block const& a = before.blocks[static_cast<std::size_t>(q.block)];
+      old_placements.erase(it);
+
+      bool changed = false;
+      if (q.top != p.top || q.left != p.left)
+      {
+        std::snprintf(line, sizeof(line), "  moved   %s from row %d, column %d to row %d, column %d\n", b.key.c_str(), q.top, q.left, p.top,
+                      p.left);
+        report(line);
+        after.block_classes[static_cast<std::size_t>(p.block)] = "diff-moved";
+      }
+      if (a.width != b.width || a.content_width != b.content_width || a.keyid_compact != b.keyid_compact)
+      {
+        std::snprintf(line, sizeof(line), "  shape   %s width %d -> %d%s\n", b.key.c_str(), a.width, b.width,
+                      a.keyid_compact == b.keyid_compact ? "" : (b.keyid_compact ? ", compacted" : ", no longer compacted"));
+        report(line);
+        changed = true;
+      }
+      if (a.height != b.height)
+      {
+        std::snprintf(line, sizeof(line), "  height  %s %d -> %d\n", b.key.c_str(), a.height, b.height);
+        report(line);
+        changed = true;
+      }
+      if (changed)
+        after.block_classes[static_cast<std::size_t>(p.block)] = "diff-changed";
+    }
+
+    // Whatever is left was not matched by a block of the new version; report in layout order.
+    for (Placement const& q : compute_placements(before))
+    {
+      std::string const& key = before.blocks[static_cast<std::size_t>(q.block)].key;
+      if (old_placements.count(key))
+        report("  removed " + key + "\n");
+    }
+  }
+
+  if (!count_pages)
+    return differences;
+  int const old_pages = page_count(old_sheets, page_rows(Orientation::portrait));
+  int const new_pages = page_count(new_sheets, page_rows(Orientation::portrait));
+  if (old_pages != new_pages)
+    report("pages: " + std::to_string(old_pages) + " -> " + std::to_string(new_pages) + "\n");
+  else
+    out += "pages: " + std::to_string(new_pages) + " (unchanged)\n";
+
+  return differences;
+}
+
+// Run `generator diff <old> <new> [--html=<file>]`; the exit code follows diff(1).
+int run_diff(std::vector<std::string> const& args)
+{
+  std::vector<std::string> inputs;
+  std::string html_path;
+  for (std::string const& arg : args)
+  {
+    if (arg.rfind("--html=", 0) == 0 && arg.size() > 7)
+      html_path = arg.substr(7);
+    else
+      inputs.push_back(arg);
+  }
+  if (inputs.size() != 2)
+  {
+    std::fputs("Usage: generator diff <old> <new> [--html=<file>]\n", stderr);
+    return 2;
+  }
+
+  try
+  {
+    std::array<std::vector<Sheet>, 2> versions;
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+      std::string path = inputs[i];
+      if (path.size() < 5 || path.compare(path.size() - 5, 5, ".json") != 0)
+        path += ".json";
+      std::vector<Diagnostic> errors;
+      json const sheets_j = parse_sheets(read_file(path), path, errors);
+      if (errors.empty())
+      {
+        versions[i] = layout_sheets(sheets_j);
+        errors = sheet_errors(versions[i]);
+      }
+      for (Diagnostic const& error : errors)
+        std::fprintf(stderr, "Error: %s: %s\n", path.c_str(), error.message.c_str());
+      if (!errors.empty())
+        return 2;
+    }
+
+    std::string report;
+    int const differences = diff_sheets(versions[0], versions[1], report);
+    write_stdout(report);
+
+    if (!html_path.empty())
+    {
+      std::string html;
+      write_document_html(html, versions[1]);
+      write_output_file(html_path, html);
+    }
+    return differences == 0 ? 0 : 1;
+  }
+  catch (std::exception const& e)
+  {
+    std::fprintf(stderr, "Error: %s\n", e.what());
+    return 2;
+  }
+}
+
+// generator edit: change the order and margins of the blocks of a sheet, and
+// its table width, in a terminal, and see the layout change with every key.
+//
+// SheetEditor holds a laid out sheet and, for each block, the Block that
+// make_block built for it before packing compacted any KEY_ID. After an edit,
+// relayout resumes GreedyPacker at the start of the row group that was open
+// when the first changed block was placed, and stops as soon as a row group
+// starts at the same unchanged block as before: from there on the old row
+// groups still hold. A change of the table width changes every row group.
+// The JSON is only brought up to date by sync_json, before it is written.
+class SheetEditor
+{
+public:
+  // The outcome of the last relayout, for the status line.
+  struct Relayout
+  {
+    std::size_t blocks_placed = 0;
+    std::size_t groups_kept = 0;
+    double seconds = 0.0;
+  };
+
+  // `sheet` is `sheet_json` as laid out by layout_sheet, without errors, sections or layout constraints.
+  SheetEditor(json& sheet_json, Sheet sheet)
+      : m_json(sheet_json)
+      , m_sheet(std::move(sheet))
+  {
+    ObjectIndex data_index(m_json.at("data"));
+    ObjectIndex margins_index(m_json.at("margins"));
+    m_specs.reserve(m_sheet.blocks.size());
+    for (auto const& [key, header_value] : m_json.at("data_headers").items())
+      m_specs.push_back(make_block(m_sheet, key, header_value, data_index.find(key), margins_index.find(key), HeaderFit::flag).value());
+
+    m_group_tops.push_back(0);
+    for (RowGroup const& group : m_sheet.groups)
+    {
+      m_group_starts.push_back(group.columns().front().blocks.front());
+      m_group_tops.push_back(m_group_tops.back() + group.height());
+    }
+  }
+
+  [[nodiscard]] Sheet const& sheet() const { return m_sheet; }
+  [[nodiscard]] int block_count() const { return static_cast<int>(m_specs.size()); }
+  [[nodiscard]] int selected() const { return m_selected; }
+  [[nodiscard]] int rows() const { return m_group_tops.back(); }
+  [[nodiscard]] Relayout const& last_relayout() const { return m_last; }
+
+  void select(int block_index) { m_selected = std::clamp(block_index, 0, std::max(0, block_count() - 1)); }
+
+  // The row group of a block.
+  [[nodiscard]] std::size_t group_of(int block_index) const
+  {
+    return static_cast<std::size_t>(std::upper_bound(m_group_starts.begin(), m_group_starts.end(), block_index) - m_group_starts.begin() - 1);
+  }
+
+  [[nodiscard]] Placement placement(int block_index) const
+  {
+    std::size_t const g = group_of(block_index);
+    std::vector<Placement> placements;
+    append_group_placements(placements, m_sheet.blocks, m_sheet.groups[g], m_group_tops[g]);
+    return *std::find_if(placements.begin(), placements.end(), [&](Placement const& p) { return p.block == block_index; });
+  }
+
+  // The placements of the blocks of the row groups that overlap table rows [first_row, last_row).
+  [[nodiscard]] std::vector<Placement> placements(int first_row, int last_row) const
+  {
+    std::vector<Placement> placements;
+    auto g = static_cast<std::size_t>(std::upper_bound(m_group_tops.begin(), m_group_tops.end() - 1, first_row) - m_group_tops.begin());
+    for (g = g > 0 ? g - 1 : 0; g < m_sheet.groups.size() && m_group_tops[g] < last_row; ++g)
+      append_group_placements(placements, m_sheet.blocks, m_sheet.groups[g], m_group_tops[g]);
+    return placements;
+  }
+
+  // Each edit returns why it cannot be made, or nothing once it is made.
+
+  // Swaps the selected block with the one `delta` (-1 or 1) places after it in data_headers order.
+  std::string move_selected(int delta)
+  {
+    int const other = m_selected + delta;
+    if (other < 0 || other >= block_count())
+      return delta < 0 ? "the block is already the first" : "the block is already the last";
+    std::swap(m_specs[static_cast<std::size_t>(m_selected)], m_specs[static_cast<std::size_t>(other)]);
+    relayout(std::min(m_selected, other), std::max(m_selected, other));
+    m_selected = other;
+    return {};
+  }
+
+  std::string adjust_margin(bool right, int delta)
+  {
+    Block& spec = m_specs[static_cast<std::size_t>(m_selected)];
+    int& margin = right ? spec.margin_right : spec.margin_left;
+    if (margin + delta < 0)
+      return std::string("the ") + (right ? "right" : "left") + " margin is already 0";
+    if (spec.width + delta > m_sheet.table_width)
+      return "the block would be wider than the table";
+    margin += delta;
+    spec.width += delta;
+    relayout(m_selected, m_selected);
+    return {};
+  }
+
+  std::string adjust_table_width(int delta)
+  {
+    int widest = 1;
+    for (Block const& spec : m_specs)
+      widest = std::max(widest, spec.width);
+    if (m_sheet.table_width + delta < widest)
+      return "the table cannot be narrower than its widest block (" + std::to_string(widest) + ")";
+    m_sheet.table_width += delta;
+    relayout(0, block_count() - 1);
+    return {};
+  }
+
+  // Writes the edits into the JSON of the sheet. Values that did not change keep their form ("2" or 2).
+  void sync_json()
+  {
+    auto set_int = [](json& object, std::string const& key, int value) {
+      json* const current = object.contains(key) ? &object[key] : nullptr;
+      Expected<int> const old = current ? parse_int(*current, key) : Expected<int>(0);
+      if (old && *old == value)
+        return;
+      if (current && current->is_string())
+        *current = std::to_string(value);
+      else
+        object[key] = value;
+    };
+    set_int(m_json["table"], "width", m_sheet.table_width);
+
+    std::unordered_map<std::string_view, Block const*> specs;
+    for (Block const& spec : m_specs)
+      specs.emplace(spec.key, &spec);
+    for (auto& [key, margin] : m_json["margins"].items())
+    {
+      auto const it = specs.find(key);
+      if (it == specs.end() || !margin.is_object())
+        continue;
+      set_int(margin, "left", it->second->margin_left);
+      set_int(margin, "right", it->second->margin_right);
+    }
+
+    // Rebuild data_headers in the new order; appending members directly keeps this linear.
+    json& headers = m_json["data_headers"];
+    auto& old_members = static_cast<JsonMembers&>(headers.get_ref<json::object_t&>());
+    std::unordered_map<std::string_view, json*> values;
+    for (auto& member : old_members)
+      values.emplace(member.first, &member.second);
+    json reordered = json::object();
+    auto& members = static_cast<JsonMembers&>(reordered.get_ref<json::object_t&>());
+    members.reserve(old_members.size());
+    for (Block const& spec : m_specs)
+      members.emplace_back(spec.key, std::move(*values.at(spec.key)));
+    headers = std::move(reordered);
+  }
+
+private:
+  void relayout(int first_changed, int last_changed)
+  {
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<Block>& blocks = m_sheet.blocks;
+    std::vector<RowGroup>& groups = m_sheet.groups;
+    BlocksScope const _blocks_scope(blocks);
+    m_last = {};
+
+    // Start over with the row group that was open when the first changed block was placed: that of the block before it.
+    std::size_t const restart = first_changed == 0 ? 0 : group_of(first_changed - 1);
+    std::vector<RowGroup> old_groups(std::make_move_iterator(groups.begin() + static_cast<std::ptrdiff_t>(restart)),
+                                     std::make_move_iterator(groups.end()));
+    std::vector<int> const old_starts(m_group_starts.begin() + static_cast<std::ptrdiff_t>(restart), m_group_starts.end());
+    groups.erase(groups.begin() + static_cast<std::ptrdiff_t>(restart), groups.end());
+    m_group_starts.resize(restart);
+    m_group_tops.resize(restart + 1);
+
+    GreedyPacker packer(groups, m_sheet.table_width);
+    std::size_t next_old = 0; // The first old row group that does not start before the block being placed.
+    bool converged = false;
+    for (int b = old_starts.empty() ? 0 : old_starts.front(); b < block_count() && !converged; ++b)
+    {
+      while (next_old < old_starts.size() && old_starts[next_old] < b)
+        ++next_old;
+      bool const old_start = b > last_changed && next_old < old_starts.size() && old_starts[next_old] == b;
+      std::optional<Block> old_block;
+      if (old_start)
+        old_block = std::move(blocks[static_cast<std::size_t>(b)]);
+      blocks[static_cast<std::size_t>(b)] = m_specs[static_cast<std::size_t>(b)];
+      ++m_last.blocks_placed;
+      if (!packer.place(b))
+        continue;
+      if (!old_start)
+      {
+        m_group_starts.push_back(b);
+        continue;
+      }
+      // A row group starts where one started before, and nothing after it changed: keep the old ones from here.
+      blocks[static_cast<std::size_t>(b)] = std::move(*old_block);
+      groups.insert(groups.end(), std::make_move_iterator(old_groups.begin() + static_cast<std::ptrdiff_t>(next_old)),
+                    std::make_move_iterator(old_groups.end()));
+      m_group_starts.insert(m_group_starts.end(), old_starts.begin() + static_cast<std::ptrdiff_t>(next_old), old_starts.end());
+      m_last.groups_kept = old_starts.size() - next_old;
+      converged = true;
+    }
+    if (!converged)
+      packer.finish();
+
+    for (std::size_t g = restart; g < groups.size(); ++g)
+      m_group_tops.push_back(m_group_tops.back() + groups[g].height());
+    m_last.seconds = seconds_since(start);
+  }
+
+  json& m_json;
+  Sheet m_sheet; // Laid out in portrait, so that its table width is the one in the JSON.
+  std::vector<Block> m_specs;       // Per block, as make_block built it.
+  std::vector<int> m_group_starts;  // Per row group: its first block.
+  std::vector<int> m_group_tops;    // Per row group: its first table row; then the number of rows.
+  int m_selected = 0;
+  Relayout m_last;
+};
+
+// The terminal in raw mode, on the alternate screen, for as long as the object lives.
+class RawTerminal
+{
+public:
+  RawTerminal()
+  {
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &m_saved) != 0)
+      throw IoError("edit needs a terminal; use --keys=<keys> to run it without one");
+    termios raw = m_saved;
+    raw.c_lflag &= ~static_cast<tcflag_t>(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~static_cast<tcflag_t>(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    write_stdout("\x1b[?1049h\x1b[?25l");
+  }
+
+  ~RawTerminal()
+  {
+    write_stdout("\x1b[?25h\x1b[?1049l");
+    std::fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &m_saved);
+  }
+
+  RawTerminal(RawTerminal const&) = delete;
+  RawTerminal& operator=(RawTerminal const&) = delete;
+
+  // The bytes that the terminal sent for the next key (one character, or an escape sequence), or nothing at the end of the input.
+  [[nodiscard]] std::string read_key()
+  {
+    if (m_pending.empty())
+    {
+      std::array<char, 256> buf;
+      ssize_t n;
+      while ((n = read(STDIN_FILENO, buf.data(), buf.size())) < 0 && errno == EINTR)
+      {
+      }
+      if (n <= 0)
+        return {};
+      m_pending.assign(buf.data(), static_cast<std::size_t>(n));
+    }
+    // Keys typed or pasted faster than they are handled arrive together.
+    std::size_t length = 1;
+    if (m_pending.size() > 2 && m_pending[0] == '\x1b' && m_pending[1] == '[')
+    {
+      length = 2;
+      while (length < m_pending.size() && !(m_pending[length] >= '@' && m_pending[length] <= '~'))
+        ++length;
+      length = std::min(length + 1, m_pending.size());
+    }
+    std::string key = m_pending.substr(0, length);
+    m_pending.erase(0, length);
+    return key;
+  }
+
+  // Rows and columns.
+  [[nodiscard]] std::pair<int, int> size() const
+  {
+    winsize ws{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0 || ws.ws_col == 0)
+      return {24, 80};
+    return {ws.ws_row, ws.ws_col};
+  }
+
+private:
+  termios m_saved;
+  std::string m_pending; // Bytes read after the last key.
+};
+
+// The state of a `generator edit` session: the whole input document, and an
+// editor for one of its sheets at a time.
+class EditSession
+{
+public:
+  // `sheets_j` as parse_sheets returns it, and as laid out; `single_sheet` if the input is one object rather than an array.
+  EditSession(std::filesystem::path path, json sheets_j, bool single_sheet, std::vector<Sheet> sheets)
+      : m_path(std::move(path))
+      , m_sheets_j(std::move(sheets_j))
+      , m_single_sheet(single_sheet)
+  {
+    for (std::size_t i = 0; i < m_sheets_j.size(); ++i)
+      if (editable(m_sheets_j[i]))
+        m_editable.push_back(i);
+    if (m_editable.empty())
+      throw std::runtime_error("there is nothing to edit: every sheet has sections or layout constraints");
+    m_editor.emplace(m_sheets_j[m_editable.front()], std::move(sheets[m_editable.front()]));
+  }
+
+  [[nodiscard]] SheetEditor const& editor() const { return *m_editor; }
+  [[nodiscard]] std::string const& status() const { return m_status; }
+  [[nodiscard]] bool modified() const { return m_modified; }
+  [[nodiscard]] std::filesystem::path const& path() const { return m_path; }
+
+  // Handles one key; returns false to quit.
+  bool handle_key(std::string_view key)
+  {
+    bool const quit_pending = m_quit_pending;
+    m_quit_pending = false;
+    m_status.clear();
+    SheetEditor& editor = *m_editor;
+    auto edit = [&](std::string refused) {
+      m_status = std::move(refused);
+      m_modified = m_modified || m_status.empty();
+    };
+
+    if (key == "j" || key == "\x1b[B")
+      editor.select(editor.selected() + 1);
+    else if (key == "k" || key == "\x1b[A")
+      editor.select(editor.selected() - 1);
+    else if (key == "\x1b[6~")
+      editor.select(editor.selected() + 10);
+    else if (key == "\x1b[5~")
+      editor.select(editor.selected() - 10);
+    else if (key == "g" || key == "\x1b[H")
+      editor.select(0);
+    else if (key == "G" || key == "\x1b[F")
+      editor.select(editor.block_count() - 1);
+    else if (editor.block_count() > 0 && (key == "[" || key == "]"))
+      edit(editor.move_selected(key == "[" ? -1 : 1));
+    else if (editor.block_count() > 0 && (key == "h" || key == "l" || key == "\x1b[D" || key == "\x1b[C"))
+      edit(editor.adjust_margin(false, key == "h" || key == "\x1b[D" ? -1 : 1));
+    else if (editor.block_count() > 0 && (key == "H" || key == "L"))
+      edit(editor.adjust_margin(true, key == "H" ? -1 : 1));
+    else if (key == "-" || key == "+" || key == "=")
+      edit(editor.adjust_table_width(key == "-" ? -1 : 1));
+    else if (key == "\t")
+      next_sheet();
+    else if (key == "w")
+      write();
+    else if (key == "q" || key == "\x03" || key == "\x04" || key.empty())
+    {
+      if (!m_modified || quit_pending || key.empty())
+        return false;
+      m_status = "There are unsaved changes: w writes them, q again quits without them.";
+      m_quit_pending = true;
+    }
+    return true;
+  }
+
+private:
+  static bool editable(json const& sheet) { return !sheet.contains("sections") && !sheet.contains("layout"); }
+
+  [[nodiscard]] std::string label(std::size_t index) const
+  {
+    return m_sheets_j.size() == 1 ? "sheet" : "sheet[" + std::to_string(index) + "]";
+  }
+
+  void next_sheet()
+  {
+    if (m_editable.size() == 1)
+    {
+      m_status = "There is no other sheet without sections or layout constraints.";
+      return;
+    }
+    m_editor->sync_json();
+    m_current = (m_current + 1) % m_editable.size();
+    std::size_t const index = m_editable[m_current];
+    m_editor.emplace(m_sheets_j[index], layout_sheet(m_sheets_j[index], label(index)));
+  }
+
+  void write()
+  {
+    m_editor->sync_json();
+    try
+    {
+      write_output_file(m_path, (m_single_sheet ? m_sheets_j[0] : m_sheets_j).dump(2) + "\n");
+      m_status = "Wrote \"" + m_path.string() + "\".";
+      m_modified = false;
+    }
+    catch (IoError const& e)
+    {
+      m_status = std::string("Error: ") + e.what();
+    }
+  }
+
+  std::filesystem::path m_path;
+  json m_sheets_j;
+  bool m_single_sheet;
+  std::vector<std::size_t> m_editable; // The sheets without sections or layout constraints.
+  std::size_t m_current = 0;           // Index into m_editable.
+  std::optional<SheetEditor> m_editor;
+  std::string m_status;
+  bool m_modified = false;
+  bool m_quit_pending = false;
+};
+
+// Draws a frame of the editor: a status line, as many table rows as fit
+// around the selected block, with two characters per table column when there
+// is room for them, and two lines about the selected block and the keys.
+// `top` is the first table row shown; it follows the selected block.
+void draw_editor(std::string& out, EditSession const& session, int screen_rows, int screen_cols, int& top)
+{
+  SheetEditor const& editor = session.editor();
+  Sheet const& sheet = editor.sheet();
+  SheetEditor::Relayout const& relayout = editor.last_relayout();
+  int const table_width = sheet.table_width;
+  int const cell_chars = table_width * 2 <= screen_cols ? 2 : 1;
+  int const visible_rows = std::max(1, screen_rows - 3);
+
+  auto line = [&](std::string_view text, std::string_view style = {}) {
+    out += style;
+    out.append(text.substr(0, static_cast<std::size_t>(screen_cols)));
+    out += "\x1b[0m\x1b[K\r\n";
+  };
+
+  out += "\x1b[H";
+  std::string header;
+  append_printf(header, "%s  %s  table.width %d  %d rows in %zu row groups  re-layout: %zu blocks placed, %zu groups kept, %.0f us%s",
+                session.path().c_str(), sheet.label.c_str(), table_width, editor.rows(), sheet.groups.size(), relayout.blocks_placed,
+                relayout.groups_kept, relayout.seconds * 1e6, session.modified() ? "  [modified]" : "");
+  line(header, "\x1b[7m");
+
+  Placement selected{};
+  if (editor.block_count() > 0)
+  {
+    selected = editor.placement(editor.selected());
+    int const height = sheet.blocks[static_cast<std::size_t>(selected.block)].height;
+    if (selected.top < top)
+      top = selected.top;
+    else if (selected.top + height > top + visible_rows)
+      top = std::min(selected.top, selected.top + height - visible_rows);
+  }
+  top = std::max(0, std::min(top, editor.rows() - visible_rows));
+
+  std::vector<Placement> const placements = editor.placements(top, top + visible_rows);
+  std::vector<int> owner(static_cast<std::size_t>(visible_rows) * static_cast<std::size_t>(table_width), -1); // Index into placements.
+  for (std::size_t i = 0; i < placements.size(); ++i)
+  {
+    Placement const& p = placements[i];
+    Block const& block = sheet.blocks[static_cast<std::size_t>(p.block)];
+    for (int r = std::max(p.top, top); r < std::min(p.top + block.height, top + visible_rows); ++r)
+      for (int c = p.left; c < p.left + block.width; ++c)
+        owner[static_cast<std::size_t>(r - top) * static_cast<std::size_t>(table_width) + static_cast<std::size_t>(c)] = static_cast<int>(i);
+  }
+
+  for (int r = 0; r < visible_rows; ++r)
+  {
+    std::string row;
+    std::string_view style;
+    int columns = 0;
+    for (int c = 0; c < table_width && columns + cell_chars <= screen_cols; ++c, columns += cell_chars)
+    {
+      int const i = owner[static_cast<std::size_t>(r) * static_cast<std::size_t>(table_width) + static_cast<std::size_t>(c)];
+      std::string_view cell_style = "\x1b[0;90m";
+      std::string cell(static_cast<std::size_t>(cell_chars), ' ');
+      if (top + r >= editor.rows())
+        cell_style = "\x1b[0m";
+      else if (i < 0)
+        cell[0] = '.';
+      else
+      {
+        Placement const& p = placements[static_cast<std::size_t>(i)];
+        Block const& block = sheet.blocks[static_cast<std::size_t>(p.block)];
+        int const block_column = c - p.left;
+        cell_style = p.block == editor.selected() ? "\x1b[0;30;43m" : (p.block % 2 ? "\x1b[0;30;46m" : "\x1b[0;97;44m");
+        if (top + r == p.top)
+        {
+          // The key across the first row of the block; bytes outside printable ASCII as '?'.
+          for (int k = 0; k < cell_chars; ++k)
+          {
+            std::size_t const at = static_cast<std::size_t>(block_column * cell_chars + k);
+            if (at < block.key.size())
+              cell[static_cast<std::size_t>(k)] = block.key[at] >= ' ' && block.key[at] <= '~' ? block.key[at] : '?';
+          }
+        }
+        else if (block_column >= block.margin_left && block_column < block.margin_left + block.content_width)
+          cell.assign(static_cast<std::size_t>(cell_chars), ':');
+      }
+      if (cell_style != style)
+      {
+        row += cell_style;
+        style = cell_style;
+      }
+      row += cell;
+    }
+    out += row;
+    out += "\x1b[0m\x1b[K\r\n";
+  }
+
+  std::string about;
+  if (editor.block_count() > 0)
+  {
+    Block const& block = sheet.blocks[static_cast<std::size_t>(selected.block)];
+    append_printf(about, "block %d of %d '%s': margins %d + %d + %d = width %d, height %d, row %d, row group %zu%s", editor.selected() + 1,
+                  editor.block_count(), block.key.c_str(), block.margin_left, block.content_width, block.margin_right, block.width,
+                  block.height, selected.top, editor.group_of(editor.selected()), block.keyid_compact ? ", compact" : "");
+  }
+  line(about);
+  std::string const& status = session.status();
+  line(!status.empty() ? std::string_view(status)
+                       : "j/k select  [/] move  h/l left margin  H/L right margin  -/+ table width  Tab next sheet  w write  q quit",
+       "\x1b[1m");
+  out += "\x1b[J";
+}
+
+// Run `generator edit <basename> [--keys=<keys>]`. With --keys the keys are
+// handled without a terminal, and the resulting layout is printed as
+// generate prints it.
+int run_edit(std::vector<std::string> const& args)
+{
+  std::string basename;
+  std::optional<std::string> keys;
+  bool usage_error = false;
+  for (std::string const& arg : args)
+  {
+    if (arg.rfind("--keys=", 0) == 0)
+      keys = arg.substr(7);
+    else if (arg.rfind("--", 0) == 0 || !basename.empty())
+      usage_error = true;
+    else
+      basename = arg;
+  }
+  if (basename.empty() || usage_error)
+  {
+    std::fputs("Usage: generator edit <basename> [--keys=<keys>]\n", stderr);
+    return 2;
+  }
+
+  std::filesystem::path const path(basename + ".json");
+  try
+  {
+    json document = parse_json(read_file(path));
+    bool const single_sheet = document.is_object();
+    json sheets_j = sheets_of(std::move(document));
+    // The edits are written back to the sheets as they are given; a derived sheet only has what it changes.
+    for (json const& sheet : sheets_j)
+    {
+      if (find_member(&sheet, "extends"))
+      {
+        std::fprintf(stderr, "Error: %s: edit does not support sheets that extend a base\n", path.c_str());
+        return 1;
+      }
+    }
+    std::vector<Sheet> sheets = layout_sheets(sheets_j);
+    std::vector<Diagnostic> const errors = sheet_errors(sheets);
+    for (Diagnostic const& error : errors)
+      std::fprintf(stderr, "Error: %s: %s\n", path.c_str(), error.message.c_str());
+    if (!errors.empty())
+      return 1;
+
+    EditSession session(path, std::move(sheets_j), single_sheet, std::move(sheets));
+    if (keys)
+    {
+      for (char const ch : *keys)
+        if (!session.handle_key(std::string_view(&ch, 1)))
+          break;
+      std::string out;
+      print_sheet_layout(out, session.editor().sheet());
+      write_stdout(out);
+      return 0;
+    }
+
+    RawTerminal terminal;
+    int top = 0;
+    do
+    {
+      auto const [rows, columns] = terminal.size();
+      std::string frame;
+      draw_editor(frame, session, rows, columns, top);
+      write_stdout(frame);
+      std::fflush(stdout);
+    } while (session.handle_key(terminal.read_key()));
+    return 0;
+  }
+  catch (std::exception const& e)
+  {
+    std::fprintf(stderr, "Error: %s\n", e.what());
+    return 2;
+  }
+}
+
+// The --explain trace of a sheet, detached from the Sheet so that it can be
+// stored in and read back from a binary log file.
+struct SheetTrace
+{
+  std::string label;
+  std::vector<std::string> keys;
+  std::vector<TraceRecord> records;
+};
+
+SheetTrace sheet_trace(Sheet const& sheet)
+{
+  SheetTrace trace;
+  trace.label = sheet.label;
+  trace.keys.reserve(sheet.blocks.size());
+  for (Block const& b : sheet.blocks)
+    trace.keys.push_back(b.key);
+  trace.records = sheet.trace;
+  return trace;
+}
+
+void print_sheet_trace(std::string& out, SheetTrace const& trace)
+{
+  char line[256];
+  std::uint64_t total_ns = 0;
+  std::uint64_t total_readded = 0;
+  int rebuilds = 0;
+  int compactions = 0;
+  int rollbacks = 0;
+
+  out += "explain " + trace.label + ":\n";
+  std::snprintf(line, sizeof(line), "  %5s  %-16s%6s%5s%10s%11s  %s\n", "#", "block", "group", "col", "re-added", "time", "decisions");
+  out += line;
+  for (TraceRecord const& r : trace.records)
+  {
+    std::string decisions;
+    auto add = [&](char const* what) { decisions += decisions.empty() ? what : std::string(", ") + what; };
+    if (r.flags & trace_new_group)
+      add("new group");
+    if (r.flags & trace_height_rebuild)
+      add("height rebuild");
+    if (r.flags & trace_compaction_rolled_back)
+      add("keyid compaction rolled back");
+    else if (r.flags & trace_compaction_attempted)
+      add("keyid compacted");
+    if (decisions.empty())
+      decisions = "appended";
+
+    std::string const& key = r.block < trace.keys.size() ? trace.keys[r.block] : "?";
+    std::snprintf(line, sizeof(line), "  %5u  %-16s%6u%5u%10u%8.1f us  %s\n", r.block, key.c_str(), r.group, r.column, r.blocks_readded,
+                  r.nanoseconds / 1000.0, decisions.c_str());
+    out += line;
+
+    total_ns += r.nanoseconds;
+    total_readded += r.blocks_readded;
+    rebuilds += (r.flags & trace_height_rebuild) ? 1 : 0;
+    compactions += (r.flags & trace_compaction_attempted) ? 1 : 0;
+    rollbacks += (r.flags & trace_compaction_rolled_back) ? 1 : 0;
+  }
+  std::snprintf(line, sizeof(line), "  %zu blocks, %d height rebuilds re-adding %llu blocks, %d keyid compactions (%d rolled back), %.1f us\n\n",
+                trace.records.size(), rebuilds, static_cast<unsigned long long>(total_readded), compactions, rollbacks, total_ns / 1000.0);
+  out += line;
+}
+
+// The binary log written by --explain=<file>: the magic, the number of
+// sheets and then per sheet its label, block keys and the raw TraceRecords,
+// every count and string length a native-endian uint32_t.
+constexpr std::string_view explain_log_magic = "PSEXPLN1";
+
+void write_explain_log(std::filesystem::path const& path, std::vector<SheetTrace> const& traces)
+{
+  std::string out(explain_log_magic);
+  auto put_u32 = [&](std::size_t value) {
+    std::uint32_t const v = static_cast<std::uint32_t>(value);
+    out.append(reinterpret_cast<char const*>(&v), sizeof(v));
+  };
+  auto put_string = [&](std::string const& s) {
+    put_u32(s.size());
+    out += s;
+  };
+
+  put_u32(traces.size());
+  for (SheetTrace const& trace : traces)
+  {
+    put_string(trace.label);
+    put_u32(trace.keys.size());
+    for (std::string const& key : trace.keys)
+      put_string(key);
+    put_u32(trace.records.size());
+    out.append(reinterpret_cast<char const*>(trace.records.data()), trace.records.size() * sizeof(TraceRecord));
+  }
+  write_output_file(path, out);
+}
+
+std::vector<SheetTrace> read_explain_log(std::filesystem::path const& path)
+{
+  std::string const in = read_file(path);
+  std::size_t pos = 0;
+  auto take = [&](std::size_t n) {
+    if (in.size() - pos < n)
+      throw std::runtime_error(path.string() + ": truncated explain log");
+    char const* p = in.data() + pos;
+    pos += n;
+    return p;
+  };
+  auto get_u32 = [&]() {
+    std::uint32_t v;
+    std::memcpy(&v, take(sizeof(v)), sizeof(v));
+    return v;
+  };
+  auto get_string = [&]() {
+    std::uint32_t const n = get_u32();
+    return std::string(take(n), n);
+  };
+  // A count of items that take at least `item_size` bytes each, checked against
+  // what is left of the log before anything is allocated for them.
+  auto get_count = [&](std::size_t item_size) {
+    std::uint32_t const n = get_u32();
+    if (n > (in.size() - pos) / item_size)
+      throw std::runtime_error(path.string() + ": truncated explain log");
+    return n;
+  };
+
+  if (std::string_view(take(explain_log_magic.size()), explain_log_magic.size()) != explain_log_magic)
+    throw std::runtime_error(path.string() + " is not an explain log");
+
+  // A sheet takes at least the three counts of its label, keys and records, a key its length.
+  std::vector<SheetTrace> traces(get_count(3 * sizeof(std::uint32_t)));
+  for (SheetTrace& trace : traces)
+  {
+    trace.label = get_string();
+    trace.keys.resize(get_count(sizeof(std::uint32_t)));
+    for (std::string& key : trace.keys)
+      key = get_string();
+    trace.records.resize(get_count(sizeof(TraceRecord)));
+    std::memcpy(trace.records.data(), take(trace.records.size() * sizeof(TraceRecord)), trace.records.size() * sizeof(TraceRecord));
+  }
+  return traces;
+}
+
+// Memory accounting for --stats and --max-memory.
+//
+// The sizes are estimates of the bytes held by each structure: the objects
+// themselves plus their heap allocations, assuming libstdc++'s 15 character
+// small string buffer. Allocator overhead is not included.
+
+std::size_t string_heap_bytes(std::string const& s)
+{
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+std::size_t json_heap_bytes(json const& j)
+{
+  std::size_t bytes = 0;
+  if (j.is_object())
+  {
+    json::object_t const& object = j.get_ref<json::object_t const&>();
+    bytes += sizeof(json::object_t) + object.capacity() * sizeof(json::object_t::value_type);
+    for (auto const& [key, value] : object)
+      bytes += string_heap_bytes(key) + json_heap_bytes(value);
+  }
+  else if (j.is_array())
+  {
+    json::array_t const& array = j.get_ref<json::array_t const&>();
+    bytes += sizeof(json::array_t) + array.capacity() * sizeof(json);
+    for (json const& value : array)
+      bytes += json_heap_bytes(value);
+  }
+  else if (j.is_string())
+    bytes += sizeof(json::string_t) + string_heap_bytes(j.get_ref<json::string_t const&>());
+  return bytes;
+}
+
+std::size_t blocks_bytes(std::vector<Block> const& blocks)
+{
+  std::size_t bytes = blocks.capacity() * sizeof(Block);
+  for (Block const& b : blocks)
+    bytes += string_heap_bytes(b.key) + string_heap_bytes(b.header) + string_heap_bytes(b.data) + string_heap_bytes(b.keyid_hex16);
+  return bytes;
+}
+
+std::size_t row_groups_bytes(std::vector<RowGroup> const& groups)
+{
+  std::size_t bytes = groups.capacity() * sizeof(RowGroup);
+  for (RowGroup const& group : groups)
+  {
+    bytes += group.columns().capacity() * sizeof(RowGroup::Column);
+    for (auto const& col : group.columns())
+      bytes += col.blocks.capacity() * sizeof(int);
+  }
+  return bytes;
+}
+
+// The current resident set size, from /proc/self/statm.
+std::size_t current_rss_bytes()
+{
+  std::FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  unsigned long size = 0;
+  unsigned long resident = 0;
+  int const n = std::fscanf(statm, "%lu %lu", &size, &resident);
+  std::fclose(statm);
+  return n == 2 ? resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+std::size_t peak_rss_bytes()
+{
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+std::string format_bytes(std::size_t bytes)
+{
+  char buf[32];
+  if (bytes < 1024)
+    std::snprintf(buf, sizeof(buf), "%zu B", bytes);
+  else if (bytes < 1024 * 1024)
+    std::snprintf(buf, sizeof(buf), "%.1f KiB", static_cast<double>(bytes) / 1024);
+  else
+    std::snprintf(buf, sizeof(buf), "%.1f MiB", static_cast<double>(bytes) / (1024 * 1024));
+  return buf;
+}
+
+struct SheetMemory
+{
+  std::size_t dom = 0;
+  std::size_t blocks = 0;
+  std::size_t row_groups = 0;
+  std::size_t output = 0;
+};
+
+// Enforces --max-memory. The budget applies to the resident set size of the
+// process, which is what gets a container OOM-killed; check() is called
+// after every phase and throws MemoryBudgetError once it is exceeded.
+class MemoryBudget
+{
+public:
+  explicit MemoryBudget(std::size_t limit)
+      : m_limit(limit)
+  {
+  }
+
+  [[nodiscard]] bool enabled() const { return m_limit != 0; }
+
+  void check(std::string const& what, std::size_t accounted_bytes) const
+  {
+    if (!enabled())
+      return;
+    std::size_t const rss = current_rss_bytes();
+    if (rss > m_limit || accounted_bytes > m_limit)
+      throw MemoryBudgetError("memory budget exceeded " + what + ": resident " + format_bytes(rss) + ", tracked data " +
+                              format_bytes(accounted_bytes) + ", --max-memory " + format_bytes(m_limit));
+  }
+
+private:
+  std::size_t m_limit = 0;
+};
+
+void print_memory_stats(std::string& out, std::string const& input_name, std::vector<Sheet> const& sheets,
+                        std::vector<SheetMemory> const& memory, std::size_t output_buffer)
+{
+  SheetMemory peak;
+  append_printf(out, "\nmemory stats for %s:\n", input_name.c_str());
+  append_printf(out, "  %-14s%14s%14s%14s%14s\n", "sheet", "json dom", "blocks", "row groups", "output");
+  for (std::size_t i = 0; i < sheets.size(); ++i)
+  {
+    SheetMemory const& m = memory[i];
+    append_printf(out, "  %-14s%14s%14s%14s%14s\n", sheets[i].label.c_str(), format_bytes(m.dom).c_str(), format_bytes(m.blocks).c_str(),
+                  format_bytes(m.row_groups).c_str(), format_bytes(m.output).c_str());
+    peak.dom = std::max(peak.dom, m.dom);
+    peak.blocks = std::max(peak.blocks, m.blocks);
+    peak.row_groups = std::max(peak.row_groups, m.row_groups);
+    peak.output = std::max(peak.output, m.output);
+  }
+  append_printf(out, "  %-14s%14s%14s%14s%14s\n", "peak", format_bytes(peak.dom).c_str(), format_bytes(peak.blocks).c_str(),
+                format_bytes(peak.row_groups).c_str(), format_bytes(peak.output).c_str());
+  append_printf(out, "  output buffer %s, peak rss %s\n", format_bytes(output_buffer).c_str(), format_bytes(peak_rss_bytes()).c_str());
+}
+
+// --find-slow: a coverage-guided search for sheets that are slow to lay out.
+//
+// Candidates are synthetic sheets described by a table width and a list of
+// block shapes. Each round mutates a candidate from the corpus and measures
+// the layout time per block, not counting the fixed cost of laying out an
+// empty sheet; a mutant is kept when it is slower than anything seen so far or
+// when it reaches a new bucket of one of the LayoutCounters (coverage). At the
+// end the slowest candidates are minimized, by removing blocks for as long as
+// the time per block stays within 10%, and written to the output directory as
+// bench corpus sheets.
+class SlowLayoutFinder
+{
+public:
+  enum class Shape { text, grid10, grid36, keyid, keyid3 };
+
+  struct BlockSpec
+  {
+    Shape shape = Shape::text;
+    int text_length = 1;
+    int margin_left = 0;
+    int margin_right = 0;
+  };
+
+  struct Candidate
+  {
+    int table_width = 37;
+    std::vector<BlockSpec> blocks;
+    double ns_per_block = 0.0;
+  };
+
+  SlowLayoutFinder(unsigned seed, int max_blocks)
+      : m_rng(seed)
+      , m_max_blocks(max_blocks)
+  {
+  }
+
+  void run(int iterations)
+  {
+    LayoutCounters counters;
+    m_fixed_ns = measure_ns(Candidate{}, counters);
+
+    Candidate seed_candidate;
+    seed_candidate.blocks.push_back({Shape::text, 10, 1, 0});
+    seed_candidate.blocks.push_back({Shape::keyid, 0, 7, 0});
+    seed_candidate.blocks.push_back({Shape::grid36, 0, 0, 0});
+    consider(std::move(seed_candidate));
+
+    for (int i = 0; i < iterations; ++i)
+    {
+      Candidate mutant = m_corpus[pick(m_corpus.size())];
+      int const mutations = 1 + static_cast<int>(pick(4));
+      for (int m = 0; m < mutations; ++m)
+        mutate(mutant);
+      consider(std::move(mutant));
+    }
+  }
+
+  // Minimize the `count` slowest candidates and write them to `directory`.
+  std::vector<std::filesystem::path> write_slowest(std::filesystem::path const& directory, int count, unsigned seed)
+  {
+    // Re-measure more carefully, so that a lucky outlier during the search does not win.
+    LayoutCounters counters;
+    for (Candidate& c : m_corpus)
+      if (static_cast<int>(c.blocks.size()) >= min_blocks)
+        c.ns_per_block = measure(c, counters, 25);
+    std::sort(m_corpus.begin(), m_corpus.end(), [](Candidate const& a, Candidate const& b) { return a.ns_per_block > b.ns_per_block; });
+    std::filesystem::create_directories(directory);
+
+    std::vector<std::filesystem::path> written;
+    for (int k = 0; k < count && k < static_cast<int>(m_corpus.size()); ++k)
+    {
+      Candidate const minimized = minimize(m_corpus[static_cast<std::size_t>(k)]);
+      std::filesystem::path const path = directory / ("slow-" + std::to_string(seed) + "-" + std::to_string(k) + ".json");
+      json sheet = to_json(minimized);
+      sheet["title"]["right"] = "find-slow: " + std::to_string(static_cast<long long>(minimized.ns_per_block)) + " ns/block";
+      write_output_file(path, sheet.dump(2) + "\n");
+      written.push_back(path);
+    }
+    return written;
+  }
+
+  [[nodiscard]] std::size_t corpus_size() const { return m_corpus.size(); }
+
+private:
+  std::size_t pick(std::size_t n) { return std::uniform_int_distribution<std::size_t>(0, n - 1)(m_rng); }
+
+  static int content_width(BlockSpec const& spec)
+  {
+    switch (spec.shape)
+    {
+      case Shape::text: return spec.text_length;
+      case Shape::grid10: return 10;
+      case Shape::grid36: return 37;
+      case Shape::keyid: return 18;
+      case Shape::keyid3: return 10;
+    }
+    return 1;
+  }
+
+  static int required_width(Candidate const& c)
+  {
+    int w = 1;
+    for (BlockSpec const& b : c.blocks)
+      w = std::max(w, content_width(b) + b.margin_left + b.margin_right);
+    return w;
+  }
+
+  BlockSpec random_block(Candidate const& c)
+  {
+    BlockSpec b;
+    // KEY_ID blocks are identified by their key, so a sheet can hold at most one of each.
+    bool const has_keyid = std::any_of(c.blocks.begin(), c.blocks.end(), [](BlockSpec const& s) { return s.shape == Shape::keyid; });
+    bool const has_keyid3 = std::any_of(c.blocks.begin(), c.blocks.end(), [](BlockSpec const& s) { return s.shape == Shape::keyid3; });
+    switch (pick(6))
+    {
+      case 0: b.shape = Shape::grid10; break;
+      case 1: b.shape = Shape::grid36; break;
+      case 2: b.shape = has_keyid ? Shape::text : Shape::keyid; break;
+      case 3: b.shape = has_keyid3 ? Shape::text : Shape::keyid3; break;
+      default: b.shape = Shape::text; break;
+    }
+    b.text_length = 1 + static_cast<int>(pick(12));
+    b.margin_left = static_cast<int>(pick(3));
+    b.margin_right = static_cast<int>(pick(2));
+    return b;
+  }
+
+  void mutate(Candidate& c)
+  {
+    std::size_t const n = c.blocks.size();
+    switch (pick(7))
+    {
+      case 0: // Insert a block.
+      case 1:
+        if (static_cast<int>(n) < m_max_blocks)
+          c.blocks.insert(c.blocks.begin() + static_cast<std::ptrdiff_t>(pick(n + 1)), random_block(c));
+        break;
+      case 2: // Remove a block.
+        if (n > 1)
+          c.blocks.erase(c.blocks.begin() + static_cast<std::ptrdiff_t>(pick(n)));
+        break;
+      case 3: // Swap two blocks.
+        if (n > 1)
+          std::swap(c.blocks[pick(n)], c.blocks[pick(n)]);
+        break;
+      case 4: // Change the margins of a block.
+      {
+        BlockSpec& b = c.blocks[pick(n)];
+        b.margin_left = static_cast<int>(pick(4));
+        b.margin_right = static_cast<int>(pick(3));
+        break;
+      }
+      case 5: // Duplicate a run of non-KEY_ID blocks.
+      {
+        std::size_t const begin = pick(n);
+        std::size_t const end = std::min(n, begin + 1 + pick(8));
+        std::vector<BlockSpec> run;
+        for (std::size_t i = begin; i < end && static_cast<int>(n + run.size()) < m_max_blocks; ++i)
+          if (c.blocks[i].shape != Shape::keyid && c.blocks[i].shape != Shape::keyid3)
+            run.push_back(c.blocks[i]);
+        c.blocks.insert(c.blocks.begin() + static_cast<std::ptrdiff_t>(end), run.begin(), run.end());
+        break;
+      }
+      case 6: // Change the table width.
+        c.table_width = std::max(required_width(c), static_cast<int>(8 + pick(2048)));
+        break;
+    }
+    c.table_width = std::max(c.table_width, required_width(c));
+  }
+
+  static json to_json(Candidate const& c)
+  {
+    json sheet;
+    sheet["title"]["left"] = "find-slow";
+    sheet["title"]["right"] = "";
+    sheet["table"]["width"] = std::to_string(c.table_width);
+    json headers = json::object();
+    json data = json::object();
+    json margins = json::object();
+    for (std::size_t i = 0; i < c.blocks.size(); ++i)
+    {
+      BlockSpec const& b = c.blocks[i];
+      std::string key = "b" + std::to_string(i);
+      std::string value;
+      switch (b.shape)
+      {
+        case Shape::text: value = std::string(static_cast<std::size_t>(b.text_length), 'x'); break;
+        case Shape::grid10: value = "grid10"; break;
+        case Shape::grid36: value = "grid36"; break;
+        case Shape::keyid: key = "keyid"; value = "0x0123456789ABCDEF"; break;
+        case Shape::keyid3: key = "keyid3"; value = "0x0123456789ABCDEF"; break;
+      }
+      headers[key] = "B" + std::to_string(i);
+      data[key] = value;
+      margins[key]["left"] = std::to_string(b.margin_left);
+      margins[key]["right"] = std::to_string(b.margin_right);
+    }
+    sheet["data_headers"] = std::move(headers);
+    sheet["data"] = std::move(data);
+    sheet["margins"] = std::move(margins);
+    return sheet;
+  }
+
+  // Lay the candidate out a few times; return the fastest time and the counters of one run.
+  static double measure_ns(Candidate const& c, LayoutCounters& counters, int repeats = 5)
+  {
+    json const sheet = to_json(c);
+    double best = 0.0;
+    for (int repeat = 0; repeat < repeats; ++repeat)
+    {
+      g_layout_counters = LayoutCounters{};
+      auto const start = std::chrono::steady_clock::now();
+      Sheet const laid_out = layout_sheet(sheet, "find-slow");
+      double const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      if (repeat == 0 || ns < best)
+        best = ns;
+    }
+    counters = g_layout_counters;
+    return best;
+  }
+
+  double measure(Candidate const& c, LayoutCounters& counters, int repeats = 5) const
+  {
+    return std::max(0.0, measure_ns(c, counters, repeats) - m_fixed_ns) / static_cast<double>(c.blocks.size());
+  }
+
+  // Coverage features: the log2 bucket of every counter.
+  static std::vector<int> features(LayoutCounters const& counters, std::size_t blocks)
+  {
+    std::array<std::uint64_t, 6> const values = {counters.rebuilds, counters.blocks_readded, counters.compaction_attempts,
+                                                 counters.compaction_rollbacks, counters.groups, blocks};
+    std::vector<int> out;
+    for (std::size_t i = 0; i < values.size(); ++i)
+    {
+      int bucket = 0;
+      for (std::uint64_t v = values[i]; v > 0; v >>= 1)
+        ++bucket;
+      out.push_back(static_cast<int>(i) * 64 + bucket);
+    }
+    return out;
+  }
+
+  void consider(Candidate candidate)
+  {
+    if (static_cast<int>(candidate.blocks.size()) < min_blocks)
+    {
+      // Too small to measure reliably; only useful as a stepping stone until the corpus has something bigger.
+      if (m_slowest == 0.0)
+        m_corpus.push_back(std::move(candidate));
+      return;
+    }
+    LayoutCounters counters;
+    candidate.ns_per_block = measure(candidate, counters);
+
+    bool interesting = candidate.ns_per_block > m_slowest;
+    for (int const feature : features(counters, candidate.blocks.size()))
+      interesting |= m_seen_features.insert(feature).second;
+
+    if (interesting)
+    {
+      m_slowest = std::max(m_slowest, candidate.ns_per_block);
+      m_corpus.push_back(std::move(candidate));
+    }
+  }
+
+  Candidate minimize(Candidate c) const
+  {
+    LayoutCounters counters;
+    double const target = 0.9 * measure(c, counters, 25);
+    for (std::size_t chunk = std::max<std::size_t>(1, c.blocks.size() / 2); chunk >= 1; chunk /= 2)
+    {
+      for (std::size_t i = 0; i + chunk <= c.blocks.size() && static_cast<int>(c.blocks.size() - chunk) >= min_blocks;)
+      {
+        Candidate smaller = c;
+        smaller.blocks.erase(smaller.blocks.begin() + static_cast<std::ptrdiff_t>(i),
+                             smaller.blocks.begin() + static_cast<std::ptrdiff_t>(i + chunk));
+        smaller.ns_per_block = measure(smaller, counters);
+        if (smaller.ns_per_block >= target)
+          c = std::move(smaller);
+        else
+          i += chunk;
+      }
+      if (chunk == 1)
+        break;
+    }
+    c.ns_per_block = measure(c, counters, 25);
+    return c;
+  }
+
+  static constexpr int min_blocks = 8;
+
+  std::mt19937 m_rng;
+  int m_max_blocks;
+  double m_fixed_ns = 0.0;
+  std::vector<Candidate> m_corpus;
+  std::set<int> m_seen_features;
+  double m_slowest = 0.0;
+};
+
+// --stress: check that parse, layout and render scale near-linearly.
+//
+// Synthetic single-sheet inputs of 10^3, 10^4, ... blocks (mostly short text
+// blocks with a grid10 every 16th block) are run through parse, layout and
+// render. The run fails if the time per block at any size exceeds
+// stress_tolerance times the time per block at 10^3 blocks.
+constexpr double stress_tolerance = 3.0;
+
+std::string synthetic_sheet_json(long blocks)
+{
+  std::string headers;
+  std::string data;
+  std::string margins;
+  for (long i = 0; i < blocks; ++i)
+  {
+    std::string const key = "\"b" + std::to_string(i) + "\"";
+    char const* separator = i == 0 ? "" : ",";
+    headers += separator + key + ":\"B" + std::to_string(i) + "\"";
+    data += separator + key + (i % 16 == 15 ? ":\"grid10\"" : ":\"" + std::to_string(1000 + i % 9000) + "\"");
+    margins += separator + key + ":{\"left\":\"" + std::to_string(i % 2) + "\"}";
+  }
+  return R"({"title":{"left":"stress","right":""},"table":{"width":"37"},"data_headers":{)" + headers + "},\"data\":{" + data +
+         "},\"margins\":{" + margins + "}}";
+}
+
+bool run_stress(long max_blocks)
+{
+  std::printf("%10s%12s%12s%12s%12s%8s\n", "blocks", "parse", "layout", "render", "ns/block", "ratio");
+  double base_ns_per_block = 0.0;
+  bool ok = true;
+  for (long blocks = 1000; blocks <= max_blocks; blocks *= 10)
+  {
+    std::string const input = synthetic_sheet_json(blocks);
+
+    auto const t0 = std::chrono::steady_clock::now();
+    json const sheets_j = sheets_of(parse_json(input)); // Without bases to resolve.
+    auto const t1 = std::chrono::steady_clock::now();
+    std::vector<Sheet> const sheets = layout_sheets(sheets_j);
+    auto const t2 = std::chrono::steady_clock::now();
+    std::string html;
+    write_document_html(html, sheets);
+    auto const t3 = std::chrono::steady_clock::now();
+
+    auto ms = [](std::chrono::steady_clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    double const ns_per_block = std::chrono::duration<double, std::nano>(t3 - t0).count() / static_cast<double>(blocks);
+    if (base_ns_per_block == 0.0)
+      base_ns_per_block = ns_per_block;
+    double const ratio = ns_per_block / base_ns_per_block;
+    std::printf("%10ld%9.1f ms%9.1f ms%9.1f ms%12.0f%7.2fx%s\n", blocks, ms(t1 - t0), ms(t2 - t1), ms(t3 - t2), ns_per_block, ratio,
+                ratio > stress_tolerance ? "  TOO SLOW" : "");
+    if (ratio > stress_tolerance)
+      ok = false;
+  }
+  std::printf("%s (tolerance %.1fx, peak rss %s)\n", ok ? "near-linear" : "FAILED: layout does not scale linearly", stress_tolerance,
+              format_bytes(peak_rss_bytes()).c_str());
+  return ok;
+}
+
+// Run parse, layout, render and write `iterations` times and report the
+// average cost of each phase. Returns the problems with the input instead if
+// it has any.
+std::vector<Diagnostic> run_bench(std::filesystem::path const& input_file_path, std::filesystem::path const& output_file_path, int iterations,
+               HtmlDialect const& html = pretty_html)
+{
+  enum Phase { parse, layout, render, write, number_of_phases };
+  static constexpr std::array<char const*, number_of_phases> phase_names = {"parse", "layout", "render", "write"};
+  std::array<PerfCounters::Sample, number_of_phases> totals{};
+
+  PerfCounters counters;
+
+  for (int iteration = 0; iteration < iterations; ++iteration)
+  {
+    counters.start();
+    std::vector<Diagnostic> errors;
+    json const sheets_j = parse_sheets(read_file(input_file_path), input_file_path, errors);
+    totals[parse] += counters.stop();
+    if (!errors.empty())
+      return errors;
+
+    counters.start();
+    std::vector<Sheet> const sheets = layout_sheets(sheets_j);
+    totals[layout] += counters.stop();
+    if (std::vector<Diagnostic> errors = sheet_errors(sheets); !errors.empty())
+      return errors;
+
+    counters.start();
+    std::string output;
+    write_document_html(output, sheets, nullptr, html);
+    totals[render] += counters.stop();
+
+    counters.start();
+    write_output_file(output_file_path, output);
+    totals[write] += counters.stop();
+  }
+
+  std::printf("bench: %s, %d iterations, ", input_file_path.c_str(), iterations);
+  if (counters.available())
+    std::printf("hardware counters enabled\n");
+  else
+    std::printf("hardware counters unavailable (%s), wall-clock only\n", counters.unavailable_reason().c_str());
+
+  std::printf("%-8s%14s", "phase", "wall/iter");
+  if (counters.available())
+    std::printf("%16s%14s%7s%14s%15s", "instructions", "cycles", "IPC", "cache-misses", "branch-misses");
+  std::printf("\n");
+
+  auto per_iteration = [&](std::uint64_t v) { return static_cast<unsigned long long>(v / static_cast<std::uint64_t>(iterations)); };
+  for (int phase = 0; phase < number_of_phases; ++phase)
+  {
+    PerfCounters::Sample const& total = totals[phase];
+    std::printf("%-8s%11.1f us", phase_names[phase], static_cast<double>(total.wall_ns) / iterations / 1000.0);
+    if (counters.available())
+    {
+      double const ipc = total.cycles ? static_cast<double>(total.instructions) / static_cast<double>(total.cycles) : 0.0;
+      std::printf("%16llu%14llu%7.2f%14llu%15llu", per_iteration(total.instructions), per_iteration(total.cycles), ipc,
+                  per_iteration(total.cache_misses), per_iteration(total.branch_misses));
+    }
+    std::printf("\n");
+  }
+
+  PerfCounters::Sample all;
+  for (PerfCounters::Sample const& total : totals)
+    all += total;
+  std::printf("%-8s%11.1f us\n", "total", static_cast<double>(all.wall_ns) / iterations / 1000.0);
+  return {};
+}
+
+// Cold-start report for --startup-profile.
+//
+// Everything before main (exec, dynamic loading and relocation, static
+// initialization) is attributed using the CPU time and page faults the
+// process had already accumulated on entry to main; after that each phase
+// is timed with the monotonic clock. The report goes to stderr.
+class StartupProfile
+{
+public:
+  StartupProfile()
+      : m_main_entry(std::chrono::steady_clock::now())
+      , m_last(m_main_entry)
+  {
+    getrusage(RUSAGE_SELF, &m_usage_at_main);
+  }
+
+  void mark(char const* phase)
+  {
+    auto const now = std::chrono::steady_clock::now();
+    m_phases.emplace_back(phase, now - m_last);
+    m_last = now;
+  }
+
+  void report() const
+  {
+    rusage usage_at_exit;
+    getrusage(RUSAGE_SELF, &usage_at_exit);
+
+    int shared_objects = 0;
+    dl_iterate_phdr(
+        [](dl_phdr_info* info, std::size_t, void* data) {
+          // The executable itself is reported with an empty name; a static binary still maps the vDSO.
+          if (info->dlpi_name && info->dlpi_name[0])
+            ++*static_cast<int*>(data);
+          return 0;
+        },
+        &shared_objects);
+
+    auto us = [](std::chrono::steady_clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+
+    std::fprintf(stderr, "startup profile:\n");
+    std::fprintf(stderr, "  %-22s%s (%d mapped objects)\n", "linkage", shared_objects > 1 ? "dynamic" : "static", shared_objects);
+    std::fprintf(stderr, "  %-22s%10.1f us\n", "cpu before main", cpu_us(m_usage_at_main));
+    for (auto const& [phase, duration] : m_phases)
+      std::fprintf(stderr, "  %-22s%10.1f us\n", phase, us(duration));
+    std::fprintf(stderr, "  %-22s%10.1f us\n", "total since main", us(m_last - m_main_entry));
+    std::fprintf(stderr, "  %-22s%10.1f us\n", "total cpu", cpu_us(usage_at_exit));
+    std::fprintf(stderr, "  %-22s%ld before main, %ld total\n", "minor page faults", m_usage_at_main.ru_minflt, usage_at_exit.ru_minflt);
+    std::fprintf(stderr, "  %-22s%ld KiB\n", "peak rss", usage_at_exit.ru_maxrss);
+  }
+
+private:
+  static double cpu_us(rusage const& usage)
+  {
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  }
+
+  std::chrono::steady_clock::time_point m_main_entry;
+  std::chrono::steady_clock::time_point m_last;
+  rusage m_usage_at_main;
+  std::vector<std::pair<char const*, std::chrono::steady_clock::duration>> m_phases;
+};
+
+enum class OutputFormat
+{
+  html,
+  tex
+};
+
+// --split: how a document of its own per sheet is named and rendered.
+struct SplitOptions
+{
+  OutputFormat format = OutputFormat::html;
+  HtmlDialect const* html = &pretty_html;
+  std::string_view head;
+  Orientation orientation = Orientation::portrait;
+  Imposition imposition;
+  Compression compression = Compression::none;
+};
+
+// A sheet's own document, as written by write_split_documents.
+struct SplitDocument
+{
+  std::filesystem::path path;
+  SheetRenderRecord record;
+  std::size_t bytes_in = 0;
+  std::size_t bytes_out = 0;
+};
+
+// The lowercase letters and digits of the title of a sheet, with a dash for
+// every run of anything else; at most 60 characters.
+std::string title_slug(Sheet const& sheet)
+{
+  std::string slug;
+  for (char const ch : sheet.title_left + " " + sheet.title_right)
+  {
+    if (std::isalnum(static_cast<unsigned char>(ch)) && static_cast<unsigned char>(ch) < 0x80)
+      slug += static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+    else if (!slug.empty() && slug.back() != '-')
+      slug += '-';
+    if (slug.size() == 60)
+      break;
+  }
+  while (!slug.empty() && slug.back() == '-')
+    slug.pop_back();
+  return slug;
+}
 
-int main(int argc, char* argv[])
+// Render every sheet into a document of its own, <basename>-<title slug>, or
+// <basename>-<number> when the slug is empty or already taken, with a further
+// -2, -3... should another sheet have taken that name too. Each worker
+// renders, compresses and writes whole files, so the documents are written
+// concurrently.
+std::vector<SplitDocument> write_split_documents(std::string const& basename, std::vector<Sheet> const& sheets, SplitOptions const& split)
 {
-  if (argc != 2)
+  bool const tex = split.format == OutputFormat::tex;
+  std::string const suffix = std::string(tex ? ".tex" : ".html") + std::string(compressed_suffix(split.compression));
+  std::vector<SplitDocument> documents(sheets.size());
+  std::set<std::string> names;
+  for (std::size_t i = 0; i < sheets.size(); ++i)
   {
-    std::cerr << "Usage: " << argv[0] << " <basename>\n";
-    std::cerr << "  Input is read from <basename>.json\n";
-    std::cerr << "  Output will be written to <basename>.html\n";
-    std::cerr << "  The input JSON may be a single object or an array of objects.\n";
-    return 1;
+    std::string name = basename + "-" + title_slug(sheets[i]);
+    if (name.size() == basename.size() + 1 || names.count(name))
+    {
+      std::string const numbered = basename + "-" + std::to_string(i + 1);
+      name = numbered;
+      for (int copy = 2; names.count(name); ++copy)
+        name = numbered + "-" + std::to_string(copy);
+    }
+    names.insert(name);
+    documents[i].path = name + suffix;
+  }
+
+  std::size_t const workers = std::min<std::size_t>(sheets.size(), std::max(1u, std::thread::hardware_concurrency()));
+  auto write = [&](std::size_t first) {
+    std::string output;
+    std::vector<SheetRenderRecord> records;
+    for (std::size_t i = first; i < sheets.size(); i += workers)
+    {
+      SplitDocument& document = documents[i];
+      OutputFile file(document.path, split.compression);
+      output.clear();
+      records.clear();
+      std::span<Sheet const> const sheet(&sheets[i], 1);
+      if (tex)
+        write_document_tex(output, sheet, &records, &file, split.orientation, split.imposition);
+      else
+        write_document_html(output, sheet, &records, *split.html, split.head, &file, split.imposition);
+      file.write(output);
+      file.close();
+      document.record = records.front();
+      document.bytes_in = file.bytes_in();
+      document.bytes_out = file.bytes_out();
+    }
+  };
+  std::vector<std::future<void>> others;
+  for (std::size_t w = 1; w < workers; ++w)
+    others.push_back(std::async(std::launch::async, write, w));
+  write(0);
+  for (auto& other : others)
+    other.get();
+  return documents;
+}
+
+// The --split=index page, which links the documents of all sheets.
+std::string split_index_html(std::vector<Sheet> const& sheets, std::vector<SplitDocument> const& documents)
+{
+  std::string index = R"(<!DOCTYPE html>
+<html>
+<head>
+  <meta http-equiv="content-type" content="text/html; charset=utf-8"/>
+  <title>passphrase</title>
+</head>
+<body>
+<ol>
+)";
+  for (std::size_t i = 0; i < sheets.size(); ++i)
+  {
+    index += "  <li><a href=\"";
+    append_html_escaped(index, documents[i].path.filename().string());
+    index += "\">";
+    Sheet const& sheet = sheets[i];
+    if (sheet.title_left.empty() && sheet.title_right.empty())
+      index += "Sheet " + std::to_string(i + 1); // As the document would be named.
+    append_html_escaped(index, sheet.title_left);
+    if (!sheet.title_left.empty() && !sheet.title_right.empty())
+      index += " &mdash; ";
+    append_html_escaped(index, sheet.title_right);
+    index += "</a></li>\n";
   }
+  index += "</ol>\n</body>\n</html>\n";
+  return index;
+}
+
+struct Options
+{
+  OutputFormat format = OutputFormat::html;
+  HeaderFit header_fit = HeaderFit::flag;
+  bool minify = false;
+  Compression compression = Compression::none;
+  std::string tar;  // With --tar: the archive to write all outputs to.
+  std::optional<Orientation> orientation; // Given with --orientation; also emits an @page rule.
+  bool auto_orientation = false;           // --orientation=auto: pick the one with the fewest pages.
+  int jobs = 1;
+  int copies = 1; // --copies
+  int nup = 1;    // --nup
+  bool split = false;       // --split: a document per sheet...
+  bool split_index = false; // ... and with --split=index, a page that links them.
+  std::string inline_css; // The stylesheet to embed, if not empty.
+  bool quiet = false;
+  bool verbose = false; // Diagnostic log on stderr.
+  bool stats = false;
+  int bench_iterations = 0;
+  int find_slow_iterations = 0;
+  long stress_blocks = 0;
+  bool explain = false;
+  std::string explain_log;
+  int find_slow_max_blocks = 256;
+  unsigned seed = 1;
+  std::size_t max_memory = 0;
+  std::string metrics;
+};
 
-  std::string const basename = argv[1];
-  std::string const input_filename = basename + ".json";
-  std::string const output_filename = basename + ".html";
+// What generate() produced for one input. Inputs are processed in parallel
+// with --jobs, so their output is collected here and reported, and written
+// to the --tar archive, in the order in which the inputs were given.
+struct GenerateResult
+{
+  bool success = false;
+  std::string out;                // Text for stdout.
+  std::string err;                // Text for stderr.
+  std::string entry_name;         // With --tar: the name of the document in the archive...
+  std::string document;           // ... and its contents.
+  std::vector<SheetTrace> traces; // With --explain=<file>: the traces of all sheets.
+};
 
+// Generate <basename>.html (or .tex) from <basename>.json, or with --tar the
+// document for the archive. Errors are reported in result.err and counted in
+// the metrics; returns false if this input failed.
+bool generate(std::string const& basename, Options const& options, DocumentHead& head, StartupProfile* startup_profile,
+              GenerateResult& result)
+{
   namespace fs = std::filesystem;
-  fs::path const input_file_path(input_filename);
-  fs::path const output_file_path(output_filename);
+  fs::path const input_file_path(basename + ".json");
+  bool const tex = options.format == OutputFormat::tex;
+  bool const archive = !options.tar.empty();
+  fs::path const output_file_path(basename + (tex ? ".tex" : ".html") + std::string(archive ? "" : compressed_suffix(options.compression)));
 
   if (!fs::exists(input_file_path))
   {
-    std::cerr << "Expected input file " << input_file_path << " does not exist.\n";
-    return 1;
+    append_printf(result.err, "Expected input file \"%s\" does not exist.\n", input_file_path.c_str());
+    g_metrics.add_error(Metrics::ErrorKind::input);
+    return false;
   }
 
   try
   {
-    std::ifstream input_file(input_file_path);
-    json const j = json::parse(input_file);
+    LogScope const _log_scope;
+    // Problems with the input are returned, not thrown: report all of them, and count the input once by the first.
+    auto report_errors = [&](std::vector<Diagnostic> const& errors) {
+      for (Diagnostic const& error : errors)
+        append_printf(result.err, "Error: %s: %s\n", input_file_path.c_str(), error.message.c_str());
+      if (!errors.empty())
+        g_metrics.add_error(errors.front().kind);
+      return errors.empty();
+    };
+
+    if (options.bench_iterations > 0)
+      return result.success = report_errors(run_bench(input_file_path, output_file_path, options.bench_iterations,
+                                                      options.minify ? minified_html : pretty_html));
 
-    json sheets = json::array();
-    if (j.is_array())
-      sheets = j;
-    else if (j.is_object())
-      sheets.push_back(j);
+    MemoryBudget const budget(options.max_memory);
+    bool const account_memory = options.stats || budget.enabled();
+
+    // Refuse inputs whose text alone exceeds the budget before building a DOM for it.
+    budget.check("reading " + input_file_path.string(), static_cast<std::size_t>(fs::file_size(input_file_path)));
+    std::string const input = read_file(input_file_path);
+    if (startup_profile)
+      startup_profile->mark("read");
+    std::vector<Diagnostic> base_errors;
+    json const sheets_j = parse_sheets(input, input_file_path, base_errors);
+    if (!report_errors(base_errors))
+      return false;
+    if (startup_profile)
+      startup_profile->mark("parse");
+    if (g_log.enabled())
+      g_log.log("%s: %zu sheets in %zu bytes of JSON\n", input_file_path.c_str(), sheets_j.size(), input.size());
+
+    std::vector<SheetMemory> memory(account_memory ? sheets_j.size() : 0);
+    std::size_t accounted = 0;
+    if (account_memory)
+    {
+      for (std::size_t i = 0; i < sheets_j.size(); ++i)
+        memory[i].dom = sizeof(json) + json_heap_bytes(sheets_j.at(i));
+      accounted = sizeof(json) + json_heap_bytes(sheets_j);
+      budget.check("after parsing " + input_file_path.string(), accounted);
+    }
+
+    LayoutOptions const layout_options{options.explain, options.header_fit, options.orientation.value_or(Orientation::portrait)};
+    std::vector<double> layout_seconds;
+    std::vector<Sheet> sheets;
+    std::optional<Orientation> page = options.orientation;
+    std::array<int, 2> pages{}; // With --orientation=auto: the page count in portrait and landscape.
+    LayoutCounters const layout_start = g_layout_counters;
+    LayoutCounters layout_counters; // Of the layout that is kept.
+    if (options.auto_orientation)
+    {
+      // Lay out both orientations at the same time; the layout engine keeps its state per thread.
+      LayoutOptions portrait_options = layout_options;
+      portrait_options.orientation = Orientation::portrait;
+      LayoutOptions landscape_options = layout_options;
+      landscape_options.orientation = Orientation::landscape;
+      std::vector<double> landscape_seconds;
+      LayoutCounters landscape_counters;
+      auto landscape = std::async(std::launch::async, [&]() {
+        LayoutCounters const start = g_layout_counters;
+        std::vector<Sheet> laid_out = layout_sheets(sheets_j, &landscape_seconds, landscape_options);
+        landscape_counters = g_layout_counters.since(start);
+        return laid_out;
+      });
+      sheets = layout_sheets(sheets_j, &layout_seconds, portrait_options);
+      layout_counters = g_layout_counters.since(layout_start);
+      std::vector<Sheet> landscape_sheets = landscape.get();
+      // The input must be valid for the portrait table width that it gives.
+      if (!report_errors(sheet_errors(sheets)))
+        return false;
+
+      pages = {page_count(sheets, page_rows(Orientation::portrait)), page_count(landscape_sheets, page_rows(Orientation::landscape))};
+      page = Orientation::portrait;
+      if (pages[1] < pages[0])
+      {
+        sheets = std::move(landscape_sheets);
+        layout_seconds = std::move(landscape_seconds);
+        layout_counters = landscape_counters;
+        page = Orientation::landscape;
+      }
+      if (g_log.enabled())
+        g_log.log("%s: %s, %d pages in portrait and %d in landscape\n", input_file_path.c_str(), orientation_name(*page), pages[0], pages[1]);
+    }
     else
-      throw std::runtime_error("top-level JSON must be an object or array of objects");
+    {
+      sheets = layout_sheets(sheets_j, &layout_seconds, layout_options);
+      layout_counters = g_layout_counters.since(layout_start);
+      if (!report_errors(sheet_errors(sheets)))
+        return false;
+    }
+    g_metrics.add_compactions(layout_counters);
+    if (startup_profile)
+      startup_profile->mark("layout");
+
+    if (account_memory)
+    {
+      for (std::size_t i = 0; i < sheets.size(); ++i)
+      {
+        for_each_table(sheets[i], [&](Sheet const& table) {
+          memory[i].blocks += blocks_bytes(table.blocks);
+          memory[i].row_groups += row_groups_bytes(table.groups);
+        });
+        accounted += memory[i].blocks + memory[i].row_groups;
+      }
+      budget.check("after layout of " + input_file_path.string(), accounted);
+    }
 
-    std::ofstream output_file(output_file_path);
-    if (!output_file)
-      throw std::runtime_error("unable to open output file " + output_file_path.string());
+    for (Sheet const& sheet : sheets)
+    {
+      for_each_table(sheet, [&](Sheet const& table) {
+        for (std::string const& warning : table.warnings)
+          append_printf(result.err, "Warning: %s: %s: %s\n", input_file_path.c_str(), table.label.c_str(), warning.c_str());
+      });
+    }
 
-    output_file << R"(<!DOCTYPE html>
-<!-- Print from Firefox (control-P) Portrait, Paper size A4, Scale 90%, Margins Default, Print headers and footers OFF -->
-<html>
-<head>
-  <meta http-equiv="content-type" content="text/html; charset=utf-8"/>
-  <title>passphrase</title>
-  <link rel="stylesheet" href="sheet.css">
-</head>
-<body>
-)";
+    if (!options.quiet)
+    {
+      for (Sheet const& sheet : sheets)
+        print_sheet_layout(result.out, sheet);
+    }
 
-    for (std::size_t i = 0; i < sheets.size(); ++i)
+    // What follows the output, whether that is one document or one per sheet.
+    auto finish = [&](std::size_t output_buffer) {
+      if (options.stats)
+      {
+        print_memory_stats(result.out, input_file_path.string(), sheets, memory, output_buffer);
+        if (options.auto_orientation)
+          append_printf(result.out, "  orientation %s: %d page(s) in portrait, %d in landscape\n", orientation_name(*page), pages[0], pages[1]);
+      }
+
+      if (options.explain)
+      {
+        if (!options.explain_log.empty())
+        {
+          for (Sheet const& sheet : sheets)
+            for_each_table(sheet, [&](Sheet const& table) { result.traces.push_back(sheet_trace(table)); });
+        }
+        else
+        {
+          result.out += "\n";
+          for (Sheet const& sheet : sheets)
+            for_each_table(sheet, [&](Sheet const& table) { print_sheet_trace(result.out, sheet_trace(table)); });
+        }
+      }
+    };
+
+    Imposition const imposition{options.copies, options.nup, page.value_or(Orientation::portrait)};
+    if (options.split)
+    {
+      HtmlDialect const& dialect = options.minify ? minified_html : pretty_html;
+      SplitOptions const split{options.format, &dialect, tex ? std::string_view{} : head.get(dialect, page), imposition.orientation,
+                               imposition, options.compression};
+      std::vector<SplitDocument> const documents = write_split_documents(basename, sheets, split);
+      fs::path const index_path(basename + ".index.html");
+      if (options.split_index)
+        write_output_file(index_path, split_index_html(sheets, documents));
+      if (startup_profile)
+        startup_profile->mark("render");
+
+      std::size_t document_bytes = 0;
+      for (std::size_t i = 0; i < sheets.size(); ++i)
+      {
+        g_metrics.add_sheet(layout_seconds[i], documents[i].record.seconds);
+        g_metrics.add_document(documents[i].bytes_in);
+        document_bytes += documents[i].bytes_in;
+        if (account_memory)
+          memory[i].output = documents[i].record.bytes;
+      }
+      if (g_log.enabled())
+        g_log.log("%s: %zu bytes of output in %zu files\n", input_file_path.c_str(), document_bytes, documents.size());
+      if (!options.quiet)
+      {
+        result.out += "\n";
+        for (SplitDocument const& document : documents)
+          append_printf(result.out, "Wrote \"%s\"\n", document.path.c_str());
+        if (options.split_index)
+          append_printf(result.out, "Wrote \"%s\"\n", index_path.c_str());
+      }
+      finish(0);
+      return result.success = true;
+    }
+
+    // Rendering hands the document to the output file in chunks; the write phase is the rest of it.
+    // For the archive the document is kept whole, to be written when it is its turn.
+    std::optional<OutputFile> output_file;
+    if (!archive)
+      output_file.emplace(output_file_path, options.compression);
+    OutputFile* const sink = output_file ? &*output_file : nullptr;
+    std::string html;
+    std::vector<SheetRenderRecord> render_records;
+    if (tex)
+      write_document_tex(html, sheets, &render_records, sink, imposition.orientation, imposition);
+    else
+    {
+      HtmlDialect const& dialect = options.minify ? minified_html : pretty_html;
+      write_document_html(html, sheets, &render_records, dialect, head.get(dialect, page), sink, imposition);
+    }
+    if (startup_profile)
+      startup_profile->mark("render");
+
+    if (account_memory)
     {
-      json const& sheet_j = sheets.at(i);
-      if (!sheet_j.is_object())
-        throw std::runtime_error("top-level array element " + std::to_string(i) + " must be an object");
+      for (std::size_t i = 0; i < sheets.size(); ++i)
+        memory[i].output = render_records[i].bytes;
+      budget.check("after rendering " + output_file_path.string(), accounted + html.capacity());
+    }
+
+    std::size_t document_bytes = html.size();
+    std::size_t const output_buffer = html.capacity();
+    if (output_file)
+    {
+      output_file->write(html);
+      output_file->close();
+      document_bytes = output_file->bytes_in();
+    }
+    else
+    {
+      result.entry_name = output_file_path.relative_path().string();
+      result.document = std::move(html);
+    }
+    if (startup_profile)
+      startup_profile->mark("write");
 
-      std::string const label = (sheets.size() == 1) ? "sheet" : ("sheet[" + std::to_string(i) + "]");
-      write_sheet_html(output_file, sheet_j, label);
+    for (std::size_t i = 0; i < sheets.size(); ++i)
+      g_metrics.add_sheet(layout_seconds[i], render_records[i].seconds);
+    g_metrics.add_document(document_bytes);
+    if (g_log.enabled())
+    {
+      for (std::size_t i = 0; i < sheets.size(); ++i)
+        g_log.log("%s: rendered %zu bytes in %.3f ms\n", sheets[i].label.c_str(), render_records[i].bytes, render_records[i].seconds * 1e3);
+      g_log.log("%s: %zu bytes of output\n", output_file_path.c_str(), document_bytes);
     }
 
-    output_file << "</body>\n</html>\n";
-    std::cout << "\nWrote " << output_file_path << "\n";
+    if (!options.quiet)
+    {
+      if (archive)
+        append_printf(result.out, "\nWrote \"%s\" into \"%s\"\n", result.entry_name.c_str(), options.tar.c_str());
+      else if (options.compression == Compression::none)
+        append_printf(result.out, "\nWrote \"%s\"\n", output_file_path.c_str());
+      else
+        append_printf(result.out, "\nWrote \"%s\" (%zu bytes, compressed from %zu)\n", output_file_path.c_str(), output_file->bytes_out(),
+                      output_file->bytes_in());
+    }
+    finish(output_buffer);
+    return result.success = true;
+  }
+  catch (json::parse_error const& e)
+  {
+    append_printf(result.err, "Error: %s: %s\n", input_file_path.c_str(), e.what());
+    g_metrics.add_error(Metrics::ErrorKind::json_syntax);
+  }
+  catch (json::exception const& e)
+  {
+    append_printf(result.err, "Error: %s: %s\n", input_file_path.c_str(), e.what());
+    g_metrics.add_error(Metrics::ErrorKind::json_schema);
+  }
+  catch (IoError const& e)
+  {
+    append_printf(result.err, "Error: %s\n", e.what());
+    g_metrics.add_error(Metrics::ErrorKind::io);
+  }
+  catch (MemoryBudgetError const& e)
+  {
+    append_printf(result.err, "Error: %s\n", e.what());
+    g_metrics.add_error(Metrics::ErrorKind::memory);
+  }
+  catch (InternalError const& e)
+  {
+    append_printf(result.err, "Error: %s: %s\n", input_file_path.c_str(), e.what());
+    g_metrics.add_error(Metrics::ErrorKind::internal);
   }
   catch (std::exception const& e)
   {
-    std::cerr << "Error: " << e.what() << "\n";
+    append_printf(result.err, "Error: %s: %s\n", input_file_path.c_str(), e.what());
+    g_metrics.add_error(Metrics::ErrorKind::validation);
+  }
+  return false;
+}
+
+// Run generate() for every input on `jobs` threads, and hand the results to
+// `consume` on this thread, in input order. Workers stay at most a few inputs
+// ahead of the consumer, so that only that many documents are held at once.
+template<typename Consume>
+void run_batch(std::vector<std::string> const& basenames, Options const& options, DocumentHead& head, StartupProfile* startup_profile,
+               Consume consume)
+{
+  // --bench prints its timings as it goes, and should not compete with other inputs anyway.
+  std::size_t const jobs =
+      options.bench_iterations > 0 ? 1 : std::min(static_cast<std::size_t>(std::max(options.jobs, 1)), basenames.size());
+  if (jobs <= 1)
+  {
+    for (std::string const& basename : basenames)
+    {
+      GenerateResult result;
+      generate(basename, options, head, startup_profile, result);
+      consume(result);
+    }
+    return;
+  }
+
+  std::size_t const window = 4 * jobs;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::optional<GenerateResult>> results(basenames.size());
+  std::size_t next = 0;     // The next input to generate.
+  std::size_t consumed = 0; // The number of results handed to `consume`.
+
+  auto worker = [&]() {
+    for (;;)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return next == basenames.size() || next < consumed + window; });
+      if (next == basenames.size())
+        return;
+      std::size_t const index = next++;
+      lock.unlock();
+
+      GenerateResult result;
+      generate(basenames[index], options, head, nullptr, result);
+
+      lock.lock();
+      results[index] = std::move(result);
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < jobs; ++i)
+    workers.emplace_back(worker);
+
+  for (std::size_t index = 0; index < basenames.size(); ++index)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&]() { return results[index].has_value(); });
+    GenerateResult result = std::move(*results[index]);
+    results[index].reset();
+    consumed = index + 1;
+    changed.notify_all();
+    lock.unlock();
+    consume(result);
+  }
+
+  for (std::thread& thread : workers)
+    thread.join();
+}
+
+// The value of a numeric option `prefix`<n>, if the rest of `arg` is a number of at least `min`.
+template<typename T>
+std::optional<T> numeric_option(std::string_view arg, std::string_view prefix, T min)
+{
+  std::string_view const value = arg.substr(prefix.size());
+  T number{};
+  auto const result = std::from_chars(value.data(), value.data() + value.size(), number);
+  if (result.ec != std::errc{} || result.ptr != value.data() + value.size() || number < min)
+    return {};
+  return number;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  if (argc >= 2 && std::string_view(argv[1]) == "diff")
+    return run_diff(std::vector<std::string>(argv + 2, argv + argc));
+
+  if (argc >= 2 && std::string_view(argv[1]) == "edit")
+    return run_edit(std::vector<std::string>(argv + 2, argv + argc));
+
+  if (argc == 3 && std::string_view(argv[1]) == "explain")
+  {
+    try
+    {
+      std::string text;
+      for (SheetTrace const& trace : read_explain_log(argv[2]))
+        print_sheet_trace(text, trace);
+      write_stdout(text);
+      return 0;
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
+  std::optional<StartupProfile> startup_profile;
+  Options options;
+  std::vector<std::string> basenames;
+  bool usage_error = false;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string const arg = argv[i];
+    if (arg == "--bench")
+      options.bench_iterations = 100;
+    else if (arg.rfind("--bench=", 0) == 0)
+    {
+      std::string_view const value = std::string_view(arg).substr(8);
+      auto const result = std::from_chars(value.data(), value.data() + value.size(), options.bench_iterations);
+      if (result.ec != std::errc{} || result.ptr != value.data() + value.size() || options.bench_iterations <= 0)
+      {
+        std::fprintf(stderr, "Invalid iteration count in %s\n", arg.c_str());
+        return 1;
+      }
+    }
+    else if (arg == "--startup-profile")
+      startup_profile.emplace();
+    else if (arg == "--quiet")
+      options.quiet = true;
+    else if (arg == "--format=html")
+      options.format = OutputFormat::html;
+    else if (arg == "--format=tex")
+      options.format = OutputFormat::tex;
+    else if (arg == "--minify")
+      options.minify = true;
+    else if (arg == "--generic-rows")
+      g_generic_rows = true;
+    else if (arg == "--verbose")
+      options.verbose = true;
+    // The last --orientation given wins.
+    else if (arg == "--orientation=portrait" || arg == "--orientation=landscape")
+    {
+      options.orientation = arg == "--orientation=portrait" ? Orientation::portrait : Orientation::landscape;
+      options.auto_orientation = false;
+    }
+    else if (arg == "--orientation=auto")
+    {
+      options.orientation.reset();
+      options.auto_orientation = true;
+    }
+    else if (arg.rfind("--tar=", 0) == 0 && arg.size() > 6)
+      options.tar = arg.substr(6);
+    else if (arg.rfind("--jobs=", 0) == 0)
+    {
+      std::string_view const value = std::string_view(arg).substr(7);
+      auto const result = std::from_chars(value.data(), value.data() + value.size(), options.jobs);
+      if (result.ec != std::errc{} || result.ptr != value.data() + value.size() || options.jobs <= 0)
+      {
+        std::fprintf(stderr, "Invalid number of jobs in %s\n", arg.c_str());
+        return 1;
+      }
+    }
+    else if (arg.rfind("--copies=", 0) == 0)
+    {
+      std::optional<int> const copies = numeric_option(arg, "--copies=", 1);
+      if (!copies)
+      {
+        std::fprintf(stderr, "Invalid number of copies in %s\n", arg.c_str());
+        return 1;
+      }
+      options.copies = *copies;
+    }
+    else if (arg.rfind("--nup=", 0) == 0)
+    {
+      std::optional<int> const nup = numeric_option(arg, "--nup=", 1);
+      if (!nup || *nup > 16)
+      {
+        std::fprintf(stderr, "Invalid number of sheets per page in %s\n", arg.c_str());
+        return 1;
+      }
+      options.nup = *nup;
+    }
+    else if (arg == "--split")
+      options.split = true;
+    else if (arg == "--split=index")
+      options.split = options.split_index = true;
+    else if (arg == "--compress=gzip")
+      options.compression = Compression::gzip;
+    else if (arg == "--compress=zstd")
+      options.compression = Compression::zstd;
+    else if (arg == "--inline-css")
+      options.inline_css = "sheet.css";
+    else if (arg.rfind("--inline-css=", 0) == 0 && arg.size() > 13)
+      options.inline_css = arg.substr(13);
+    else if (arg == "--header-fit=flag")
+      options.header_fit = HeaderFit::flag;
+    else if (arg == "--header-fit=abbreviate")
+      options.header_fit = HeaderFit::abbreviate;
+    else if (arg == "--header-fit=widen")
+      options.header_fit = HeaderFit::widen;
+    else if (arg.rfind("--metrics=", 0) == 0 && arg.size() > 10)
+      options.metrics = arg.substr(10);
+    else if (arg == "--stats")
+      options.stats = true;
+    else if (arg == "--explain")
+      options.explain = true;
+    else if (arg.rfind("--explain=", 0) == 0 && arg.size() > 10)
+    {
+      options.explain = true;
+      options.explain_log = arg.substr(10);
+    }
+    else if (arg == "--stress")
+      options.stress_blocks = 1000000;
+    else if (arg.rfind("--stress=", 0) == 0)
+    {
+      std::string_view const value = std::string_view(arg).substr(9);
+      auto const result = std::from_chars(value.data(), value.data() + value.size(), options.stress_blocks);
+      if (result.ec != std::errc{} || result.ptr != value.data() + value.size() || options.stress_blocks < 1000)
+      {
+        std::fprintf(stderr, "Invalid block count in %s (the minimum is 1000)\n", arg.c_str());
+        return 1;
+      }
+    }
+    else if (arg == "--find-slow")
+      options.find_slow_iterations = 2000;
+    else if (arg.rfind("--find-slow=", 0) == 0)
+    {
+      std::optional<int> const iterations = numeric_option(arg, "--find-slow=", 1);
+      if (!iterations)
+      {
+        std::fprintf(stderr, "Invalid number in %s\n", arg.c_str());
+        return 1;
+      }
+      options.find_slow_iterations = *iterations;
+    }
+    else if (arg.rfind("--max-blocks=", 0) == 0)
+    {
+      std::optional<int> const max_blocks = numeric_option(arg, "--max-blocks=", 1);
+      if (!max_blocks)
+      {
+        std::fprintf(stderr, "Invalid number in %s\n", arg.c_str());
+        return 1;
+      }
+      options.find_slow_max_blocks = *max_blocks;
+    }
+    else if (arg.rfind("--seed=", 0) == 0)
+    {
+      std::optional<unsigned> const seed = numeric_option(arg, "--seed=", 0u);
+      if (!seed)
+      {
+        std::fprintf(stderr, "Invalid number in %s\n", arg.c_str());
+        return 1;
+      }
+      options.seed = *seed;
+    }
+    else if (arg.rfind("--max-memory=", 0) == 0)
+    {
+      std::string_view const value = std::string_view(arg).substr(13);
+      unsigned long long amount = 0;
+      auto const result = std::from_chars(value.data(), value.data() + value.size(), amount);
+      std::string_view const suffix = value.substr(static_cast<std::size_t>(result.ptr - value.data()));
+      unsigned long long multiplier = 0;
+      if (suffix.empty())
+        multiplier = 1;
+      else if (suffix == "K" || suffix == "k")
+        multiplier = 1024;
+      else if (suffix == "M" || suffix == "m")
+        multiplier = 1024 * 1024;
+      else if (suffix == "G" || suffix == "g")
+        multiplier = 1024 * 1024 * 1024;
+      if (result.ec != std::errc{} || result.ptr == value.data() || multiplier == 0 || amount == 0)
+      {
+        std::fprintf(stderr, "Invalid memory size in %s\n", arg.c_str());
+        return 1;
+      }
+      options.max_memory = static_cast<std::size_t>(amount * multiplier);
+    }
+    else if (arg.rfind("--", 0) != 0)
+      basenames.push_back(arg);
+    else
+      usage_error = true;
+  }
+
+  if (options.stress_blocks > 0 && !usage_error)
+  {
+    try
+    {
+      return run_stress(options.stress_blocks) ? 0 : 1;
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
+  if (options.split && !options.tar.empty())
+  {
+    std::fputs("--split writes a file per sheet and cannot be combined with --tar\n", stderr);
+    return 1;
+  }
+
+  if (basenames.empty() || usage_error)
+  {
+    std::fprintf(stderr, "Usage: %s [options] <basename>...\n", argv[0]);
+    std::fprintf(stderr, "       %s explain <logfile>\n", argv[0]);
+    std::fprintf(stderr, "       %s diff <old> <new> [--html=<file>]\n", argv[0]);
+    std::fprintf(stderr, "       %s edit <basename> [--keys=<keys>]\n", argv[0]);
+    std::fputs("  Input is read from <basename>.json\n"
+               "  Output will be written to <basename>.html, or <basename>.tex with --format=tex\n"
+               "  The input JSON may be a single object or an array of objects.\n"
+               "  A sheet with \"extends\" deep-merges its members over a base: the sheet of the input with that\n"
+               "  \"id\", or a JSON file relative to the input, with <file>#<id> for one of its sheets.\n"
+               "  When more than one basename is given they are processed as one batch.\n"
+               "  edit shows the layout in the terminal and lays it out again as the order and margins of the\n"
+               "  blocks and the table width are changed, then writes them back to <basename>.json; with\n"
+               "  --keys it handles those keys without a terminal and prints the layout.\n"
+               "Options:\n"
+               "  --quiet            Do not print the computed layout.\n"
+               "  --verbose          Log diagnostics (layout and render times, packing, orientation) to stderr,\n"
+               "                     the lines of each input and sheet kept together.\n"
+               "  --format=<fmt>     html (default) or tex: a LaTeX document with a TikZ picture per sheet.\n"
+               "  --minify           Write the HTML without formatting whitespace, optional closing tags or per-cell classes\n"
+               "                     where sheet.css can do without them, and grid labels that sheet.css generates;\n"
+               "                     roughly 2.8-3x smaller.\n"
+               "  --generic-rows     Render every row cell by cell, without the rows built at compile time; for\n"
+               "                     benchmarking (make bench-rows), the output is the same.\n"
+               "  --compress=<gzip|zstd>\n"
+               "                     Compress the output while it is rendered, to <basename>.html.gz or .html.zst;\n"
+               "                     zstd uses a worker thread per core.\n"
+               "  --orientation=<portrait|landscape|auto>\n"
+               "                     Lay out for that paper orientation, with a matching @page rule. The table\n"
+               "                     widths in the input are for portrait, landscape gets proportionally more\n"
+               "                     columns. auto lays out both and picks the one with the fewest pages.\n"
+               "  --tar=<file>       Write all outputs, and sheet.css, into one tar archive instead of separate files;\n"
+               "                     compressed to <file>.gz or <file>.zst with --compress.\n"
+               "  --jobs=<n>         Process the inputs of a batch on n threads; output stays in input order.\n"
+               "  --split[=index]    Write every sheet to a file of its own, <basename>-<title>.html, or with the\n"
+               "                     number of the sheet when its title is empty or taken, rendered and written in\n"
+               "                     parallel; with index, also <basename>.index.html, which links them all.\n"
+               "  --copies=<n>       Print every sheet n times, the copies of a sheet one after the other. Each\n"
+               "                     sheet is rendered once; the TeX output places it as one PDF form XObject.\n"
+               "  --nup=<k>          Put k (up to 16) copies on a page, scaled down to fit, with cut marks between.\n"
+               "  --inline-css[=<file>]\n"
+               "                     Embed a minified copy of the stylesheet (default sheet.css) instead of linking\n"
+               "                     to sheet.css, so that each output is a single self-contained file.\n"
+               "  --header-fit=<policy>\n"
+               "                     What to do with a header that would wrap in the width of its block, measured\n"
+               "                     with the metrics of the fonts in sheet.css: flag (default) warns, abbreviate\n"
+               "                     shortens it with an ellipsis, widen widens the block to the right first.\n"
+               "  --metrics=<dest>   After the run, write Prometheus metrics to the file <dest>\n"
+               "                     (replaced atomically) or to the Unix socket unix:<path>.\n"
+               "  --explain[=<file>] Trace the layout decisions for every block: its group and column, height rebuilds,\n"
+               "                     keyid compactions and the time they cost. Printed after the run, or stored as a\n"
+               "                     binary log in <file> to be printed later with 'generator explain <file>'.\n"
+               "  --stats            Report the memory held by the JSON DOM, blocks, row groups and output, per sheet,\n"
+               "                     and the peak RSS.\n"
+               "  --max-memory=<n>[K|M|G]\n"
+               "                     Fail an input with an error as soon as the process exceeds n bytes resident.\n"
+               "  --startup-profile  Report where the time of a single run goes, including before main, on stderr.\n"
+               "  --bench[=<n>]      Time the parse, layout, render and write phases over n iterations (default 100),\n"
+               "                     using hardware performance counters when available.\n"
+               "  --stress[=<n>]     Check that parse, layout and render scale near-linearly, from 1000 up to n blocks\n"
+               "                     (default 1000000) in a single sheet; no basename is needed.\n"
+               "  --find-slow[=<n>]  Search n mutations (default 2000) for sheets that are slow to lay out and store the\n"
+               "                     three slowest, minimized, in the directory given instead of a basename.\n"
+               "    --max-blocks=<n> Largest sheet to try (default 256 blocks).\n"
+               "    --seed=<n>       Random seed of the search (default 1).\n",
+               stderr);
     return 1;
   }
+
+  if (options.find_slow_iterations > 0)
+  {
+    // The (single) positional argument is the directory to store the slow cases in.
+    if (basenames.size() != 1)
+    {
+      std::fprintf(stderr, "--find-slow takes exactly one output directory.\n");
+      return 1;
+    }
+    try
+    {
+      SlowLayoutFinder finder(options.seed, options.find_slow_max_blocks);
+      finder.run(options.find_slow_iterations);
+      std::printf("find-slow: %d iterations, %zu interesting candidates\n", options.find_slow_iterations, finder.corpus_size());
+      for (auto const& path : finder.write_slowest(basenames[0], 3, options.seed))
+        std::printf("Wrote \"%s\"\n", path.c_str());
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  if (options.verbose)
+    g_log.start(stderr);
+
+  bool success = true;
+  std::vector<SheetTrace> traces;
+  DocumentHead head(options.inline_css);
+  std::optional<TarWriter> tar;
+  if (!options.tar.empty())
+  {
+    try
+    {
+      // The same modification time for every entry; SOURCE_DATE_EPOCH makes the archive reproducible.
+      char const* source_date_epoch = std::getenv("SOURCE_DATE_EPOCH");
+      long long const mtime = source_date_epoch ? std::atoll(source_date_epoch) : static_cast<long long>(std::time(nullptr));
+      tar.emplace(options.tar + std::string(compressed_suffix(options.compression)), options.compression, mtime);
+      // The stylesheet that the documents link to.
+      if (options.inline_css.empty())
+        tar->add("sheet.css", read_file("sheet.css"));
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      return 1;
+    }
+  }
+
+  run_batch(basenames, options, head, startup_profile ? &*startup_profile : nullptr, [&](GenerateResult& result) {
+    write_stdout(result.out);
+    write_stderr(result.err);
+    success = success && result.success;
+    traces.insert(traces.end(), std::make_move_iterator(result.traces.begin()), std::make_move_iterator(result.traces.end()));
+    if (tar && result.success)
+    {
+      try
+      {
+        tar->add(result.entry_name, result.document);
+      }
+      catch (std::exception const& e)
+      {
+        std::fprintf(stderr, "Error: %s\n", e.what());
+        success = false;
+        tar.reset();
+      }
+    }
+  });
+  g_log.stop();
+
+  if (tar)
+  {
+    try
+    {
+      tar->close();
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      success = false;
+    }
+  }
+
+  if (!options.explain_log.empty())
+  {
+    try
+    {
+      write_explain_log(options.explain_log, traces);
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      success = false;
+    }
+  }
+
+  if (startup_profile)
+    startup_profile->report();
+
+  if (!options.metrics.empty())
+  {
+    try
+    {
+      write_metrics(options.metrics, g_metrics.prometheus_text());
+    }
+    catch (std::exception const& e)
+    {
+      std::fprintf(stderr, "Error: %s\n", e.what());
+      success = false;
+    }
+  }
+
+  return success ? 0 : 1;
 }